@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+namespace arena {
+  struct Stats {
+    // requests served, and their bytes, since the arena was made
+    size_t allocations = 0;
+    size_t bytes = 0;
+    // blocks taken from the heap, and their bytes
+    size_t blocks = 0;
+    size_t reserved = 0;
+    size_t resets = 0;
+  };
+
+  // A bump allocator for scratch memory that lives as long as one expression
+  // is worked on. Nothing is freed on its own; reset() makes all of it
+  // available again at once but keeps the blocks, so once an arena has seen
+  // the largest expression it never goes to the heap again.
+  class Arena {
+    struct Block {
+      char *data;
+      size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t block = 0, used = 0;
+    size_t first;
+    Stats counters;
+
+   public:
+    explicit Arena(size_t first = 64 << 10): first(first) {}
+    Arena(const Arena&) = delete;
+    Arena &operator=(const Arena&) = delete;
+
+    ~Arena() {
+      for (auto &b : blocks)
+        free(b.data);
+    }
+
+    void *allocate(size_t bytes, size_t align) {
+      counters.allocations++;
+      counters.bytes += bytes;
+      while (true) {
+        if (block < blocks.size()) {
+          size_t start = (used + align - 1) & ~(align - 1);
+          if (start + bytes <= blocks[block].size) {
+            used = start + bytes;
+            return blocks[block].data + start;
+          }
+          block++;
+          used = 0;
+          continue;
+        }
+        // every block is twice the last, so there are few of them
+        size_t size = std::max(bytes + align, blocks.empty() ? first : blocks.back().size * 2);
+        blocks.push_back({ (char*)malloc(size), size });
+        counters.blocks++;
+        counters.reserved += size;
+      }
+    }
+
+    void reset() {
+      block = 0;
+      used = 0;
+      counters.resets++;
+    }
+
+    const Stats &stats() const {
+      return counters;
+    }
+  };
+
+  namespace {
+    thread_local Arena *active = nullptr;
+  }
+
+  // Makes scratch containers created on this thread allocate from arena until
+  // the scope ends. Scopes nest; outside of any, they use the heap as usual.
+  class Scope {
+    Arena *previous;
+
+   public:
+    explicit Scope(Arena &arena): previous(active) {
+      active = &arena;
+    }
+
+    ~Scope() {
+      active = previous;
+    }
+
+    Scope(const Scope&) = delete;
+    Scope &operator=(const Scope&) = delete;
+  };
+
+  // Allocates from the arena of the scope it was made in, if any. Memory is
+  // given back only when the arena is reset, so containers using it must not
+  // outlive that.
+  template<typename T>
+  struct Allocator {
+    typedef T value_type;
+
+    Arena *arena;
+
+    Allocator(): arena(active) {}
+
+    template<typename U>
+    Allocator(const Allocator<U> &other): arena(other.arena) {}
+
+    T *allocate(size_t n) {
+      if (arena)
+        return (T*)arena->allocate(n * sizeof(T), alignof(T));
+      return (T*)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t) {
+      if (!arena)
+        ::operator delete(p);
+    }
+  };
+
+  template<typename T, typename U>
+  bool operator==(const Allocator<T> &a, const Allocator<U> &b) {
+    return a.arena == b.arena;
+  }
+
+  template<typename T, typename U>
+  bool operator!=(const Allocator<T> &a, const Allocator<U> &b) {
+    return a.arena != b.arena;
+  }
+
+  template<typename T>
+  using Vector = std::vector<T, Allocator<T>>;
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstring>
+
+#include "parser.h"
+#include "pool.h"
+#include "vm.h"
+
+namespace batch {
+  // Rows evaluated per pass over the program: enough to amortize the dispatch
+  // on each instruction, few enough for the block stack to stay in cache.
+  const size_t block = 256;
+
+  // Rows per task when a batch is spread over threads: a few blocks, so that
+  // one task's slice of every column stays in the core's cache.
+  const size_t chunk = 16 * block;
+
+  namespace {
+    inline double lane(const double *b, size_t i) {
+      return b[i];
+    }
+
+    inline double lane(double b, size_t) {
+      return b;
+    }
+
+    // Full blocks get a loop with a constant trip count, which compilers
+    // vectorize without a scalar remainder even at -O2.
+    template<typename F>
+    void map(double *__restrict a, size_t n, F fn) {
+      if (n == block)
+        for (size_t i = 0; i < block; i++)
+          a[i] = fn(a[i]);
+      else
+        for (size_t i = 0; i < n; i++)
+          a[i] = fn(a[i]);
+    }
+
+    // b is either a block or a single value applied to every row.
+    template<typename B, typename F>
+    void zip(double *__restrict a, B b, size_t n, F fn) {
+      if (n == block)
+        for (size_t i = 0; i < block; i++)
+          a[i] = fn(a[i], lane(b, i));
+      else
+        for (size_t i = 0; i < n; i++)
+          a[i] = fn(a[i], lane(b, i));
+    }
+
+    bool is_binary(vm::Opcode op) {
+      switch (op) {
+        case vm::And: case vm::Or: case vm::Xor: case vm::Rsh: case vm::Lsh:
+        case vm::Add: case vm::Sub: case vm::Mul: case vm::Div: case vm::Rem: case vm::Exp:
+        case vm::Atan2: case vm::Pow:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    // Applies fn in double precision, or in single for an instruction of
+    // Float32 bytecode, as vm::run does.
+    #define m_1(fn) (instr.arg ? map(a, n, [](double x) { return (double)fn((float)x); }) : map(a, n, l_1(fn)))
+    #define z_2(fn) (instr.arg ? zip(a, b, n, [](double x, double y) { return (double)fn((float)x, (float)y); }) \
+                               : zip(a, b, n, l_2(fn)))
+
+    // a op= b, elementwise over n rows.
+    template<typename B>
+    void binary(vm::Instr instr, double *a, B b, size_t n) {
+      switch (instr.op) {
+        case vm::And:   zip(a, b, n, [](double x, double y) { return vm::raw(vm::bits(x) & vm::bits(y)); }); break;
+        case vm::Or:    zip(a, b, n, [](double x, double y) { return vm::raw(vm::bits(x) | vm::bits(y)); }); break;
+        case vm::Xor:   zip(a, b, n, [](double x, double y) { return vm::raw(vm::bits(x) ^ vm::bits(y)); }); break;
+        case vm::Rsh:
+          zip(a, b, n, [](double x, double y) { return vm::raw(parser::Operator::shift_right(vm::bits(x), vm::bits(y))); });
+          break;
+        case vm::Lsh:
+          zip(a, b, n, [](double x, double y) { return vm::raw(parser::Operator::shift_left(vm::bits(x), vm::bits(y))); });
+          break;
+        case vm::Add:   zip(a, b, n, [](double x, double y) { return x + y; }); break;
+        case vm::Sub:   zip(a, b, n, [](double x, double y) { return x - y; }); break;
+        case vm::Mul:   zip(a, b, n, [](double x, double y) { return x * y; }); break;
+        case vm::Div:   zip(a, b, n, [](double x, double y) { return x / y; }); break;
+        case vm::Rem:   zip(a, b, n, l_2(fmod)); break;
+        case vm::Exp:   z_2(std::pow); break;
+        case vm::Atan2: z_2(std::atan2); break;
+        case vm::Pow:   z_2(std::pow); break;
+        default: break;
+      }
+    }
+
+    void unary(vm::Instr instr, double *a, size_t n) {
+      switch (instr.op) {
+        case vm::Int:   map(a, n, [](double x) { return vm::raw(parser::Operator::integer(x)); }); break;
+        case vm::Float:
+          if (instr.arg)
+            map(a, n, [](double x) { return (double)(float)vm::bits(x); });
+          else
+            map(a, n, [](double x) { return (double)vm::bits(x); });
+          break;
+        case vm::Single: map(a, n, [](double x) { return (double)(float)x; }); break;
+        case vm::Not:   map(a, n, [](double x) { return vm::raw(~vm::bits(x)); }); break;
+        case vm::Neg:   map(a, n, [](double x) { return -x; }); break;
+        case vm::Abs:   m_1(std::abs); break;
+        case vm::Acos:  m_1(std::acos); break;
+        case vm::Acosh: m_1(std::acosh); break;
+        case vm::Asin:  m_1(std::asin); break;
+        case vm::Asinh: m_1(std::asinh); break;
+        case vm::Atan:  m_1(std::atan); break;
+        case vm::Atanh: m_1(std::atanh); break;
+        case vm::Cbrt:  m_1(std::cbrt); break;
+        case vm::Ceil:  m_1(std::ceil); break;
+        case vm::Cos:   m_1(std::cos); break;
+        case vm::Cosh:  m_1(std::cosh); break;
+        case vm::Fexp:  m_1(std::exp); break;
+        case vm::Floor: m_1(std::floor); break;
+        case vm::Log:   m_1(std::log); break;
+        case vm::Log10: m_1(std::log10); break;
+        case vm::Log2:  m_1(std::log2); break;
+        case vm::Round: m_1(std::round); break;
+        case vm::Sin:   m_1(std::sin); break;
+        case vm::Sinh:  m_1(std::sinh); break;
+        case vm::Sqrt:  m_1(std::sqrt); break;
+        case vm::Tan:   m_1(std::tan); break;
+        case vm::Tanh:  m_1(std::tanh); break;
+        case vm::Trunc: m_1(std::trunc); break;
+        default: break;
+      }
+    }
+
+    // parser::Function::hypot of the argc argument blocks starting at a, into
+    // a, a block at a time: the largest magnitude of each row first, then the
+    // sum of the rows' scaled squares.
+    void hypot(double *a, uint32_t argc, size_t n) {
+      if (argc == 2) {
+        zip(a, (const double*)a + block, n, l_2(std::hypot));
+        return;
+      }
+      double d[block], s[block];
+      for (size_t i = 0; i < n; i++)
+        d[i] = std::abs(a[i]);
+      for (uint32_t k = 1; k < argc; k++)
+        zip(d, (const double*)a + k * block, n, [](double m, double x) { return parser::Function::max(m, std::abs(x)); });
+      map(d, n, [](double m) { return m == 0 ? 1 : m; });
+      for (size_t i = 0; i < n; i++)
+        s[i] = a[i] / d[i] * (a[i] / d[i]);
+      for (uint32_t k = 1; k < argc; k++) {
+        const double *x = a + k * block;
+        for (size_t i = 0; i < n; i++)
+          s[i] += x[i] / d[i] * (x[i] / d[i]);
+      }
+      for (size_t i = 0; i < n; i++)
+        a[i] = std::isinf(d[i]) ? d[i] : d[i] * std::sqrt(s[i]);
+    }
+
+    // Reduces the argc argument blocks starting at a into a, the same way
+    // vm::eval does for a single row.
+    void variadic(vm::Opcode op, double *a, uint32_t argc, size_t n) {
+      if (op == vm::Hypot)
+        return hypot(a, argc, n);
+      // pairwise, as parser::Function::tree
+      for (uint32_t width = 1; width < argc; width *= 2)
+        for (uint32_t i = 0; i + width < argc; i += 2 * width)
+          if (op == vm::Max)
+            zip(a + i * block, (const double*)a + (i + width) * block, n, l_2(parser::Function::max));
+          else
+            zip(a + i * block, (const double*)a + (i + width) * block, n, l_2(parser::Function::min));
+    }
+  }
+
+  // Evaluates bytecode for rows rows at once, column at a time: columns[slot]
+  // points to the rows values of each input slot and outputs[k] receives one
+  // result per row for output k, or outputs[0] the only result. Every
+  // instruction is dispatched once per block of rows, not once per row, and
+  // runs as a loop the compiler can vectorize. A constant or an input that is
+  // the right operand of a binary operation is read in place rather than
+  // copied to the stack first.
+  bool eval(const vm::Bytecode &bytecode, const double *const *columns, size_t rows, double *const *outputs) {
+    stats::Timer timer(stats::Batch);
+    if (bytecode.slots() && !columns) {
+      printf("Missing input columns\n");
+      return false;
+    }
+    std::vector<double> stack(bytecode.depth() * block), temps(bytecode.temps() * block);
+    auto &code = bytecode.code();
+    auto constants = bytecode.constants().data();
+    for (size_t row = 0; row < rows; row += block) {
+      size_t n = std::min(block, rows - row);
+      // top points at the first free block
+      double *top = stack.data();
+      for (size_t pc = 0; pc < code.size(); pc++) {
+        auto &instr = code[pc];
+        bool fuse = pc + 1 < code.size() && is_binary(code[pc + 1].op);
+        switch (instr.op) {
+          case vm::Const:
+            if (fuse)
+              binary(code[++pc], top - block, constants[instr.arg], n);
+            else {
+              std::fill(top, top + n, constants[instr.arg]);
+              top += block;
+            }
+            break;
+          case vm::Var:
+            if (fuse)
+              binary(code[++pc], top - block, columns[instr.arg] + row, n);
+            else {
+              memcpy(top, columns[instr.arg] + row, n * sizeof(double));
+              top += block;
+            }
+            break;
+          case vm::IntVar:
+            for (size_t i = 0; i < n; i++)
+              top[i] = vm::raw(parser::Operator::integer(columns[instr.arg][row + i]));
+            top += block;
+            break;
+          case vm::Store:
+            memcpy(&temps[instr.arg * block], top - block, n * sizeof(double));
+            break;
+          case vm::Load:
+            memcpy(top, &temps[instr.arg * block], n * sizeof(double));
+            top += block;
+            break;
+          case vm::Drop:
+            top -= instr.arg * block;
+            break;
+          case vm::Zero:
+            std::fill(top, top + n, 0.0);
+            top += block;
+            break;
+          case vm::Output:
+            top -= block;
+            memcpy(outputs[instr.arg] + row, top, n * sizeof(double));
+            break;
+          case vm::Hypot: case vm::Max: case vm::Min:
+            top -= (instr.arg - 1) * block;
+            variadic(instr.op, top - block, instr.arg, n);
+            break;
+          default:
+            if (is_binary(instr.op)) {
+              top -= block;
+              binary(instr, top - block, (const double*)top, n);
+            } else unary(instr, top - block, n);
+        }
+      }
+      if (!bytecode.outputs())
+        memcpy(outputs[0] + row, stack.data(), n * sizeof(double));
+    }
+    return true;
+  }
+
+  bool eval(const vm::Bytecode &bytecode, const double *const *columns, size_t rows, double *out) {
+    return eval(bytecode, columns, rows, &out);
+  }
+
+  bool eval(const parser::Program &program, const double *const *columns, size_t rows, double *out) {
+    vm::Bytecode bytecode;
+    return vm::Bytecode::compile(program, bytecode) && eval(bytecode, columns, rows, out);
+  }
+
+  // Runs kernel(columns, rows, out), anything with the signature of the
+  // eval overloads above or llir::BatchKernel, over chunks of the rows on
+  // every thread of pool. Each row is computed exactly as on one thread, so
+  // the output does not depend on the schedule. Chunks start on cache line
+  // boundaries of out, so no two threads ever write the same line.
+  template<typename K>
+  void parallel(pool::Pool &pool, K kernel, size_t slots, const double *const *columns, size_t rows, double *out) {
+    const size_t line = 64 / sizeof(double);
+    size_t skew = (reinterpret_cast<uintptr_t>(out) / sizeof(double)) % line;
+    auto start = [&](size_t task) { return std::min(rows, task ? task * chunk - skew : 0); };
+    pool.run((rows + skew + chunk - 1) / chunk, [&](size_t task) {
+      size_t row = start(task), n = start(task + 1) - row;
+      std::vector<const double*> slice(slots);
+      for (size_t slot = 0; slot < slots; slot++)
+        slice[slot] = columns[slot] + row;
+      kernel(slice.data(), n, out + row);
+    });
+  }
+
+  bool eval(const vm::Bytecode &bytecode, const double *const *columns, size_t rows, double *out, pool::Pool &pool) {
+    if (bytecode.slots() && !columns) {
+      printf("Missing input columns\n");
+      return false;
+    }
+    parallel(pool, [&](const double *const *columns, size_t rows, double *out) {
+      eval(bytecode, columns, rows, out);
+    }, bytecode.slots(), columns, rows, out);
+    return true;
+  }
+}
@@ -0,0 +1,330 @@
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <numeric>
+#include <regex>
+
+#include "batch.h"
+#include "formula.h"
+#include "parser.h"
+#include "simplify.h"
+#include "stats.h"
+#include "stream.h"
+#include "vm.h"
+
+// Every heap allocation of the process, so that bench_arena can show there are
+// none left in the steady state.
+void *operator new(size_t size) {
+  stats::allocated();
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  std::abort();
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+namespace legacy {
+  using namespace parser;
+
+  const std::string function_pat = ([]() {
+    std::vector<std::string> name_v(token_to_function.size());
+    std::transform(token_to_function.begin(), token_to_function.end(), name_v.begin(),
+      [&](auto &kv) { return kv.first; });
+    std::sort(name_v.begin(), name_v.end(), [](auto &a, auto &b) { return a.length() > b.length(); });
+    return std::accumulate(name_v.begin(), name_v.end(), std::string(),
+      [](auto a, auto b) { return (a.empty() ? "" : a + "|") + b; });
+  })();
+
+  // The std::regex tokenizer parse_infix used to be, kept as the baseline.
+  bool parse_infix(const std::string &expr, TokenizedExpr &infix) {
+    static const std::regex token_rx(
+        "((?:\\d+(?:\\.\\d*)?|\\.\\d+)(?:e[+-]?\\d+)?)|"
+        "([()]|\\*{2}|[-+~,\\/*%|&^]|<<|>>)|"
+        "(" + function_pat + "(?=\\s*\\())|"
+        "(e|pi)|"
+        "(\\s+)|"
+        "(.)",
+        std::regex::icase);
+    std::sregex_iterator iter(expr.begin(), expr.end(), token_rx), end;
+    for (; iter != end; iter++)
+      for (size_t i = 1; i < iter->size(); i++)
+        if ((*iter)[i].matched) {
+          auto key = iter->str();
+          switch (i) {
+            case Token::Value: {
+              auto value = stod(key);
+              infix.push_back(Token(value));
+              break;
+            }
+            case Token::Operator: {
+              Operator::Type operator_ = token_to_operator.at(key);
+              if ((infix.empty() || (!infix.back().is_value() && infix.back().operator_() != Operator::Rbr)) &&
+                  operator_as_unary.find(operator_) != operator_as_unary.end())
+                operator_ = operator_as_unary.at(operator_);
+              if (!infix.empty() && infix.back().is_function())
+                operator_ = Operator::Fn;
+              infix.push_back(Token(operator_));
+              break;
+            }
+            case Token::Function: {
+              Function::Type function = token_to_function.at(key);
+              infix.push_back(Token(function));
+              break;
+            }
+            case Token::Constant: {
+              std::transform(key.begin(), key.end(), key.begin(), l_1(std::tolower));
+              auto value = const_to_value.at(key);
+              infix.push_back(Token(value));
+              break;
+            }
+            case Token::Whitespace:
+              break;
+            case Token::Invalid:
+            default: {
+              printf("Invalid character '%c' at position %ld\n", key[0], iter->position());
+              return false;
+            }
+          }
+        }
+    return true;
+  }
+}
+
+namespace {
+  constexpr const char *sample =
+    "-1 + 5 * (6 + 2) - 12 / 4 + 2**4 + pi - e * 1.01e-1 - (1 << 5) + -hypot(1, -2, 3) * max(1, 2, min(4, 5))";
+
+  std::string generate(size_t length) {
+    std::string expr = sample;
+    for (int i = 0; expr.length() < length; i++)
+      expr += (i % 2 ? " - " : " + ") + std::string(sample);
+    return expr;
+  }
+
+  bool same(parser::TokenizedExpr &a, parser::TokenizedExpr &b) {
+    if (a.size() != b.size())
+      return false;
+    for (auto i = a.begin(), j = b.begin(); i != a.end(); i++, j++)
+      if (i->is_value() != j->is_value() || i->value() != j->value() ||
+          i->operator_() != j->operator_() || i->function() != j->function())
+        return false;
+    return true;
+  }
+
+  double time_ns(const std::string &expr, int runs, bool (*parse)(const std::string&, parser::TokenizedExpr&)) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+      parser::TokenizedExpr infix;
+      parse(expr, infix);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / runs;
+  }
+
+  constexpr const char *formula = "sqrt(x*x + y*y) * sin(x) + max(x, y, 1) - x**2 / (1 + y)";
+
+  // Compares per-row interpretation against batch::eval over input columns.
+  bool bench_batch(size_t rows) {
+    parser::TokenizedExpr infix;
+    parser::Program program;
+    if (!parser::parse_infix(formula, infix) || !parser::shunting_yard(infix, program))
+      return false;
+    std::vector<double> x(rows), y(rows), expected(rows), actual(rows);
+    for (size_t i = 0; i < rows; i++) {
+      x[i] = i * 0.001;
+      y[i] = 1.0 / (i + 1);
+    }
+    const double *columns[] = { x.data(), y.data() };
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rows; i++) {
+      const double vars[] = { x[i], y[i] };
+      parser::eval(program, expected[i], vars);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    batch::eval(program, columns, rows, actual.data());
+    auto stop = std::chrono::steady_clock::now();
+
+    if (expected != actual) {
+      printf("Batch results differ from the interpreter\n");
+      return false;
+    }
+    std::chrono::duration<double, std::nano> scalar = middle - start, blocked = stop - middle;
+    printf("\n%10s %14s %14s %8s\n", "rows", "eval ns/row", "batch ns/row", "speedup");
+    printf("%10zu %14.2lf %14.2lf %7.1lfx\n", rows, scalar.count() / rows, blocked.count() / rows,
+      scalar.count() / blocked.count());
+    return true;
+  }
+
+  // Compares the generic eval<double> against the bytecode interpreter, one
+  // row at a time, on the sample and on the formula before and after simplify.
+  bool bench_vm(size_t rows) {
+    printf("\n%-10s %14s %14s %8s\n", "program", "eval ns/row", "vm ns/row", "speedup");
+    const std::pair<const char *, const char *> cases[] = {
+      { "sample", sample }, { "formula", formula }, { "simplified", formula } };
+    for (auto &c : cases) {
+      parser::TokenizedExpr infix;
+      parser::Variables variables;
+      parser::Program program;
+      vm::Bytecode bytecode;
+      if (!parser::parse_infix(c.second, infix, variables) || !parser::shunting_yard(infix, program) ||
+          (c.first == cases[2].first && !simplify::simplify(parser::Program(program), program)) ||
+          !vm::Bytecode::compile(program, bytecode))
+        return false;
+      std::vector<double> expected(rows), actual(rows);
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < rows; i++) {
+        const double vars[] = { i * 0.001, 1.0 / (i + 1) };
+        parser::eval(program, expected[i], vars);
+      }
+      auto middle = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < rows; i++) {
+        const double vars[] = { i * 0.001, 1.0 / (i + 1) };
+        vm::eval(bytecode, actual[i], vars);
+      }
+      auto stop = std::chrono::steady_clock::now();
+      if (expected != actual) {
+        printf("Bytecode results differ from the interpreter\n");
+        return false;
+      }
+      std::chrono::duration<double, std::nano> generic = middle - start, bytecoded = stop - middle;
+      printf("%-10s %14.2lf %14.2lf %7.1lfx\n", c.first, generic.count() / rows, bytecoded.count() / rows,
+        generic.count() / bytecoded.count());
+    }
+    return true;
+  }
+
+  // Runs float32 bytecode before and after simplify, which folds constants
+  // in single precision too, so the two must agree to the bit.
+  bool bench_float32(size_t rows) {
+    printf("\n%-10s %14s %14s %8s\n", "float32", "-O0 ns/row", "-O1 ns/row", "speedup");
+    const std::pair<const char *, const char *> cases[] = {
+      { "sample", sample }, { "formula", formula },
+      { "constants", "0.1 + 0.2 - 0.3 + x * (sin(0.1) * 3 + 2**0.5) - hypot(0.1, 0.2, y) + ((1 << 25) | 1) / 7" } };
+    for (auto &c : cases) {
+      parser::TokenizedExpr infix;
+      parser::Variables variables;
+      parser::Program program, simplified;
+      vm::Bytecode plain, folded;
+      if (!parser::parse_infix(c.second, infix, variables) || !parser::shunting_yard(infix, program) ||
+          !simplify::simplify(program, simplified, parser::Math::Float32) ||
+          !vm::Bytecode::compile(program, plain, parser::Math::Float32) ||
+          !vm::Bytecode::compile(simplified, folded, parser::Math::Float32))
+        return false;
+      std::vector<double> expected(rows), actual(rows);
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < rows; i++) {
+        const double vars[] = { i * 0.001, 1.0 / (i + 1) };
+        vm::eval(plain, expected[i], vars);
+      }
+      auto middle = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < rows; i++) {
+        const double vars[] = { i * 0.001, 1.0 / (i + 1) };
+        vm::eval(folded, actual[i], vars);
+      }
+      auto stop = std::chrono::steady_clock::now();
+      if (memcmp(expected.data(), actual.data(), rows * sizeof(double))) {
+        printf("Float32 results differ between -O0 and -O1\n");
+        return false;
+      }
+      std::chrono::duration<double, std::nano> unfolded = middle - start, simple = stop - middle;
+      printf("%-10s %14.2lf %14.2lf %7.1lfx\n", c.first, unfolded.count() / rows, simple.count() / rows,
+        unfolded.count() / simple.count());
+    }
+    return true;
+  }
+}
+
+namespace {
+  // Compares the bytecode interpreter against the same expressions compiled
+  // along with the program by FORMULA. The compiler may turn pow(x, 2) into
+  // x * x, so results are only held to libm's last bit.
+  template<typename F>
+  bool bench_formula(const char *name, const char *text, F compiled, size_t rows) {
+    parser::TokenizedExpr infix;
+    parser::Program program;
+    vm::Bytecode bytecode;
+    if (!parser::parse_infix(text, infix) || !parser::shunting_yard(infix, program) ||
+        !vm::Bytecode::compile(program, bytecode))
+      return false;
+    std::vector<double> expected(rows), actual(rows);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rows; i++) {
+      const double vars[] = { i * 0.001, 1.0 / (i + 1) };
+      vm::eval(bytecode, expected[i], vars);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rows; i++) {
+      const double vars[] = { i * 0.001, 1.0 / (i + 1) };
+      actual[i] = compiled(vars);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rows; i++)
+      if (std::abs(expected[i] - actual[i]) > 1e-15 * std::abs(expected[i])) {
+        printf("FORMULA results differ from the bytecode interpreter\n");
+        return false;
+      }
+    std::chrono::duration<double, std::nano> bytecoded = middle - start, native = stop - middle;
+    printf("%-10s %14.2lf %14.2lf %7.1lfx\n", name, bytecoded.count() / rows, native.count() / rows,
+      bytecoded.count() / native.count());
+    return true;
+  }
+
+  bool bench_formula(size_t rows) {
+    printf("\n%-10s %14s %14s %8s\n", "program", "vm ns/row", "FORMULA ns/row", "speedup");
+    return bench_formula("sample", sample, FORMULA(sample), rows) &&
+      bench_formula("formula", formula, FORMULA(formula), rows);
+  }
+}
+
+namespace {
+  // Translates the same lines over and over, as streaming does, and counts the
+  // heap allocations of every pass after the first.
+  bool bench_arena(size_t lines) {
+    printf("\n%-6s %12s %14s %12s %12s\n", "level", "ns/line", "heap allocs", "arena blocks", "arena KiB");
+    std::vector<std::string> exprs;
+    for (size_t i = 0; i < lines; i++)
+      exprs.push_back(i % 2 ? sample : formula);
+    parser::Variables names { "x", "y" };
+    for (unsigned int level : { 0u, 1u }) {
+      stream::Translator translator(names, level);
+      vm::Bytecode bytecode;
+      for (auto &expr : exprs)
+        if (!translator.translate(expr.data(), expr.length(), bytecode))
+          return false;
+      size_t before = stats::allocations();
+      auto start = std::chrono::steady_clock::now();
+      for (auto &expr : exprs)
+        translator.translate(expr.data(), expr.length(), bytecode);
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      auto &stats = translator.stats();
+      printf("-O%-4u %12.1lf %14zu %12zu %12zu\n", level, elapsed.count() / lines, stats::allocations() - before,
+        stats.blocks, stats.reserved >> 10);
+    }
+    return true;
+  }
+}
+
+int main() {
+  printf("%10s %10s %14s %14s %8s\n", "bytes", "tokens", "regex ns/B", "lexer ns/B", "speedup");
+  for (size_t length : {1 << 8, 1 << 12, 1 << 16, 1 << 20}) {
+    auto expr = generate(length);
+    parser::TokenizedExpr expected, actual;
+    if (!legacy::parse_infix(expr, expected) || !parser::parse_infix(expr, actual) || !same(expected, actual)) {
+      printf("Token streams differ for %zu bytes\n", expr.length());
+      return 1;
+    }
+    int runs = std::max(1, (int)((1 << 22) / expr.length()));
+    double regex = time_ns(expr, std::max(1, runs / 16), legacy::parse_infix);
+    double lexer = time_ns(expr, runs, parser::parse_infix);
+    printf("%10zu %10zu %14.2lf %14.2lf %7.1lfx\n", expr.length(), actual.size(),
+      regex / expr.length(), lexer / expr.length(), regex / lexer);
+  }
+  return bench_batch(1 << 20) && bench_vm(1 << 18) && bench_float32(1 << 18) && bench_formula(1 << 18) && bench_arena(1 << 16) ? 0 : 1;
+}
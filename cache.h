@@ -0,0 +1,231 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "llir.h"
+#include "parser.h"
+#include "simplify.h"
+#include "vm.h"
+
+namespace cache {
+  // One compiled expression. Entries are shared, so one that is evicted
+  // stays valid for as long as someone still holds it.
+  struct Entry {
+    parser::Variables variables;
+    parser::Program program;
+    vm::Bytecode bytecode;
+    // null unless the cache JIT-compiles
+    llir::Kernel kernel = nullptr;
+    llir::Tracker tracker;
+
+    ~Entry() {
+      if (tracker)
+        llvm::consumeError(tracker->remove());
+    }
+  };
+
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  namespace {
+    // Whitespace only matters between two characters that could otherwise
+    // run together into one token, so it is dropped next to parentheses and
+    // commas and collapsed elsewhere. Everything else is kept as written:
+    // variable names are case-sensitive.
+    std::string normalize(const std::string &expr) {
+      std::string out;
+      out.reserve(expr.length());
+      bool space = false;
+      for (char c : expr) {
+        if (isspace((unsigned char)c)) {
+          space = true;
+          continue;
+        }
+        if (space && !out.empty() && !strchr("(),", out.back()) && !strchr("(),", c))
+          out += ' ';
+        space = false;
+        out += c;
+      }
+      return out;
+    }
+
+    template<typename T>
+    void append(std::string &key, T value) {
+      key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // The token stream in a form that ignores how the expression was spelled:
+    // whitespace is gone, constants are values and function names are ids.
+    std::string canonical(const parser::TokenizedExpr &infix, const parser::Variables &variables) {
+      std::string key;
+      key.reserve(infix.size() * 9);
+      for (auto &token : infix) {
+        if (token.is_value()) {
+          key += 'v';
+          append(key, token.value());
+        } else if (token.is_variable()) {
+          key += 'x';
+          append(key, token.slot());
+        } else if (token.is_operator()) {
+          key += 'o';
+          append(key, token.operator_());
+        } else if (token.is_function()) {
+          key += 'f';
+          append(key, token.function());
+        }
+      }
+      for (auto &name : variables)
+        key += '\0' + name;
+      return key;
+    }
+  }
+
+  // A least recently used cache in front of parse_infix, shunting_yard,
+  // simplify and the JIT, bounded by an estimate of the memory its entries
+  // take. A lookup first tries the normalized text, which skips everything;
+  // then the canonical token stream, which still skips parsing and
+  // compiling. Safe to use from several threads.
+  class Cache {
+    struct Slot {
+      std::shared_ptr<Entry> entry;
+      std::vector<std::string> texts;
+      std::string tokens;
+      size_t bytes;
+    };
+
+    size_t capacity;
+    unsigned int level;
+    bool jit;
+    parser::Math::Mode mode;
+    std::list<Slot> order;
+    std::unordered_map<std::string, std::list<Slot>::iterator> by_text, by_tokens;
+    Stats counters;
+    std::mutex lock;
+    std::mutex compiling;
+    llir::Compiler compiler;
+
+    void touch(std::list<Slot>::iterator slot) {
+      order.splice(order.begin(), order, slot);
+    }
+
+    void evict() {
+      while (counters.bytes > capacity && order.size() > 1) {
+        auto &slot = order.back();
+        for (auto &text : slot.texts)
+          by_text.erase(text);
+        by_tokens.erase(slot.tokens);
+        counters.bytes -= slot.bytes;
+        counters.evictions++;
+        order.pop_back();
+      }
+      counters.entries = order.size();
+    }
+
+    void alias(std::list<Slot>::iterator slot, const std::string &text) {
+      if (!by_text.emplace(text, slot).second)
+        return;
+      slot->texts.push_back(text);
+      slot->bytes += text.length();
+      counters.bytes += text.length();
+    }
+
+    bool build(const parser::TokenizedExpr &infix, Entry &entry) {
+      if (!parser::shunting_yard(infix, entry.program))
+        return false;
+      if (level && !simplify::simplify(parser::Program(entry.program), entry.program, mode))
+        return false;
+      if (!vm::Bytecode::compile(entry.program, entry.bytecode, mode))
+        return false;
+      if (jit) {
+        std::lock_guard<std::mutex> guard(compiling);
+        return compiler.jit(entry.program, entry.kernel, level, &entry.tracker);
+      }
+      return true;
+    }
+
+   public:
+    // JIT code is not ours to measure, so every kernel is counted as the few
+    // pages the JIT maps for its code and data.
+    static const size_t kernel_bytes = 3 * 4096;
+
+    // capacity is in bytes; level is the -O level expressions are built at
+    // and mode how they compute.
+    explicit Cache(size_t capacity, unsigned int level = 0, bool jit = true, parser::Math::Mode mode = parser::Math::Strict):
+      capacity(capacity), level(level), jit(jit), mode(mode) {
+      compiler.math(mode);
+    }
+
+    Cache(const Cache&) = delete;
+    Cache &operator=(const Cache&) = delete;
+
+    // Finds or builds the compiled form of expr.
+    bool get(const std::string &expr, std::shared_ptr<const Entry> &out) {
+      auto text = normalize(expr);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = by_text.find(text);
+        if (it != by_text.end()) {
+          counters.hits++;
+          this->touch(it->second);
+          out = it->second->entry;
+          return true;
+        }
+      }
+      auto entry = std::make_shared<Entry>();
+      parser::TokenizedExpr infix;
+      if (!parser::parse_infix(expr, infix, entry->variables))
+        return false;
+      auto tokens = canonical(infix, entry->variables);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = by_tokens.find(tokens);
+        if (it != by_tokens.end()) {
+          counters.hits++;
+          this->touch(it->second);
+          this->alias(it->second, text);
+          out = it->second->entry;
+          this->evict();
+          return true;
+        }
+        counters.misses++;
+      }
+      if (!this->build(infix, *entry))
+        return false;
+      std::lock_guard<std::mutex> guard(lock);
+      // another thread may have built the same expression meanwhile
+      auto it = by_tokens.find(tokens);
+      if (it != by_tokens.end()) {
+        this->touch(it->second);
+        this->alias(it->second, text);
+        out = it->second->entry;
+        return true;
+      }
+      size_t bytes = sizeof(Slot) + sizeof(Entry) + 2 * tokens.length() +
+        entry->program.code().size() * sizeof(parser::Token) +
+        entry->bytecode.code().size() * sizeof(vm::Instr) +
+        entry->bytecode.constants().size() * sizeof(double) +
+        (entry->kernel ? kernel_bytes : 0);
+      for (auto &name : entry->variables)
+        bytes += name.length();
+      order.push_front({ entry, {}, tokens, bytes });
+      by_tokens.emplace(tokens, order.begin());
+      counters.bytes += bytes;
+      this->alias(order.begin(), text);
+      out = entry;
+      this->evict();
+      return true;
+    }
+
+    Stats stats() {
+      std::lock_guard<std::mutex> guard(lock);
+      return counters;
+    }
+  };
+}
@@ -0,0 +1,474 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parser.h"
+
+namespace columnar {
+  // Column types, as stored in a columnar file.
+  enum Type : uint32_t { Float64 = 0, Int64 = 1 };
+
+  // A columnar file is a header, one descriptor per column and the columns
+  // themselves, each rows values of 8 bytes starting on a 64-byte boundary of
+  // the file. Everything is little-endian.
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t columns;
+    uint64_t rows;
+  };
+
+  struct Descriptor {
+    char name[48];
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+  };
+  static_assert(sizeof(Header) == 24 && sizeof(Descriptor) == 64, "the layout of the file is fixed");
+
+  namespace {
+    const char magic[8] = { 'A', 'R', 'I', 'Y', 'A', 'C', 'O', 'L' };
+    const char arrow_magic[6] = { 'A', 'R', 'R', 'O', 'W', '1' };
+
+    size_t align(size_t n) {
+      return (n + 63) & ~(size_t)63;
+    }
+
+    // A table of a FlatBuffers buffer, read in place with every offset checked
+    // against the buffer, which is all of Arrow's metadata that is needed.
+    struct Flat {
+      const uint8_t *data = nullptr;
+      size_t size = 0, pos = 0;
+
+      template<typename T>
+      bool read(size_t at, T &out) const {
+        if (at > size || size - at < sizeof(T))
+          return false;
+        memcpy(&out, data + at, sizeof(T));
+        return true;
+      }
+
+      static bool root(const uint8_t *data, size_t size, Flat &out) {
+        uint32_t offset;
+        out = { data, size, 0 };
+        return out.read(0, offset) && out.at(offset, out);
+      }
+
+      bool at(size_t pos, Flat &out) const {
+        int32_t vtable;
+        out = { data, size, pos };
+        return this->read(pos, vtable) && pos - vtable < size;
+      }
+
+      // Where field id is stored in this table, or 0 if it is not.
+      size_t field(unsigned int id) const {
+        int32_t vtable;
+        uint16_t length, offset;
+        if (!this->read(pos, vtable))
+          return 0;
+        size_t v = pos - vtable;
+        if (!this->read(v, length) || 4 + 2 * id >= length || !this->read(v + 4 + 2 * id, offset) || !offset)
+          return 0;
+        return pos + offset;
+      }
+
+      template<typename T>
+      T scalar(unsigned int id, T otherwise) const {
+        size_t at = this->field(id);
+        T out;
+        return at && this->read(at, out) ? out : otherwise;
+      }
+
+      // The target of the offset stored in field id.
+      bool follow(unsigned int id, size_t &out) const {
+        size_t at = this->field(id);
+        uint32_t offset;
+        if (!at || !this->read(at, offset))
+          return false;
+        out = at + offset;
+        return out < size;
+      }
+
+      bool table(unsigned int id, Flat &out) const {
+        size_t at;
+        return this->follow(id, at) && this->at(at, out);
+      }
+
+      // A vector of count elements of width bytes from begin.
+      bool vector(unsigned int id, size_t width, size_t &begin, uint32_t &count) const {
+        size_t at;
+        if (!this->follow(id, at) || !this->read(at, count))
+          return false;
+        begin = at + 4;
+        return begin <= size && (size - begin) / width >= count;
+      }
+
+      // Element i of a vector of tables.
+      bool element(size_t begin, uint32_t i, Flat &out) const {
+        uint32_t offset;
+        size_t at = begin + 4 * (size_t)i;
+        return this->read(at, offset) && this->at(at + offset, out);
+      }
+
+      bool string(unsigned int id, std::string &out) const {
+        size_t begin;
+        uint32_t count;
+        if (!this->vector(id, 1, begin, count))
+          return false;
+        out.assign((const char*)data + begin, count);
+        return true;
+      }
+    };
+  }
+
+  // A file mapped into memory, read-only or, when created, shared so that
+  // what is written to it goes to the file.
+  class Mapping {
+    int fd = -1;
+    uint8_t *_data = nullptr;
+    size_t _size = 0;
+
+   public:
+    Mapping() = default;
+    Mapping(const Mapping&) = delete;
+    Mapping &operator=(const Mapping&) = delete;
+
+    ~Mapping() {
+      if (_data)
+        munmap(_data, _size);
+      if (fd >= 0)
+        close(fd);
+    }
+
+    bool open(const std::string &path) {
+      struct stat info;
+      if ((fd = ::open(path.c_str(), O_RDONLY)) < 0 || fstat(fd, &info)) {
+        printf("Cannot open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+      }
+      _size = info.st_size;
+      if (!_size)
+        return true;
+      void *map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        printf("Cannot map %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+      }
+      _data = (uint8_t*)map;
+      madvise(_data, _size, MADV_SEQUENTIAL);
+      return true;
+    }
+
+    // Creates path of size bytes, replacing any file there, and maps it.
+    bool create(const std::string &path, size_t size) {
+      if ((fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, size)) {
+        printf("Cannot create %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+      }
+      void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED) {
+        printf("Cannot map %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+      }
+      _data = (uint8_t*)map;
+      _size = size;
+      madvise(_data, _size, MADV_SEQUENTIAL);
+      return true;
+    }
+
+    uint8_t *data() const {
+      return _data;
+    }
+
+    size_t size() const {
+      return _size;
+    }
+  };
+
+  struct Field {
+    std::string name;
+    Type type;
+  };
+
+  // Rows that are stored together: every column of a columnar file, or one
+  // record batch of an Arrow file. columns[k] points into the mapping.
+  struct Chunk {
+    size_t rows;
+    std::vector<const void*> columns;
+  };
+
+  // The columns of a columnar file or of an Arrow IPC file, mapped and never
+  // copied. Only float64 and int64 columns without nulls are read.
+  class Table {
+    Mapping file;
+    std::vector<Field> _fields;
+    std::vector<Chunk> _chunks;
+    size_t _rows = 0;
+
+    bool in_file(uint64_t offset, uint64_t length) const {
+      return offset <= file.size() && length <= file.size() - offset && offset % 8 == 0;
+    }
+
+    bool columnar(const std::string &path) {
+      Header header;
+      if (file.size() < sizeof(header)) {
+        printf("Columnar file %s is truncated\n", path.c_str());
+        return false;
+      }
+      memcpy(&header, file.data(), sizeof(header));
+      if (header.version != 1 || (file.size() - sizeof(header)) / sizeof(Descriptor) < header.columns) {
+        printf("Columnar file %s is of an unknown version or truncated\n", path.c_str());
+        return false;
+      }
+      Chunk chunk { header.rows, {} };
+      for (uint32_t k = 0; k < header.columns; k++) {
+        Descriptor column;
+        memcpy(&column, file.data() + sizeof(header) + k * sizeof(column), sizeof(column));
+        if (column.type > Int64 || !memchr(column.name, 0, sizeof(column.name)) ||
+            header.rows > file.size() / 8 || !this->in_file(column.offset, header.rows * 8)) {
+          printf("Column %u of %s is malformed\n", k, path.c_str());
+          return false;
+        }
+        _fields.push_back({ column.name, (Type)column.type });
+        chunk.columns.push_back(file.data() + column.offset);
+      }
+      _rows = header.rows;
+      _chunks.push_back(std::move(chunk));
+      return true;
+    }
+
+    // The IPC file format: magic, stream, footer, footer length and magic.
+    // The footer lists the schema and where each record batch is.
+    bool arrow(const std::string &path) {
+      auto data = file.data();
+      size_t size = file.size();
+      int32_t length;
+      Flat footer, schema;
+      size_t begin;
+      uint32_t count;
+      if (size < 18 || memcmp(data + size - 6, arrow_magic, 6) ||
+          (memcpy(&length, data + size - 10, 4), length < 0 || (size_t)length > size - 18) ||
+          !Flat::root(data + size - 10 - length, length, footer) || !footer.table(1, schema) ||
+          !schema.vector(1, 4, begin, count)) {
+        printf("Arrow file %s is malformed\n", path.c_str());
+        return false;
+      }
+      for (uint32_t k = 0; k < count; k++) {
+        Flat field, type;
+        std::string name;
+        if (!schema.element(begin, k, field) || !field.string(0, name)) {
+          printf("Arrow file %s is malformed\n", path.c_str());
+          return false;
+        }
+        // the Type union: 2 is Int, 3 is FloatingPoint
+        uint8_t tag = field.scalar<uint8_t>(2, 0);
+        bool has_type = field.table(3, type);
+        if (has_type && tag == 2 && type.scalar<int32_t>(0, 0) == 64 && type.scalar<uint8_t>(1, 0))
+          _fields.push_back({ name, Int64 });
+        else if (has_type && tag == 3 && type.scalar<int16_t>(0, 0) == 2)
+          _fields.push_back({ name, Float64 });
+        else {
+          printf("Column '%s' of %s is neither float64 nor int64\n", name.c_str(), path.c_str());
+          return false;
+        }
+      }
+      // Block { int64 offset; int32 metaDataLength; int64 bodyLength; }
+      if (!footer.vector(3, 24, begin, count)) {
+        printf("Arrow file %s is malformed\n", path.c_str());
+        return false;
+      }
+      for (uint32_t b = 0; b < count; b++) {
+        int64_t offset, body;
+        int32_t metadata;
+        if (!footer.read(begin + 24 * b, offset) || !footer.read(begin + 24 * b + 8, metadata) ||
+            !footer.read(begin + 24 * b + 16, body)) {
+          printf("Arrow file %s is malformed\n", path.c_str());
+          return false;
+        }
+        if (!this->batch(path, offset, metadata, body))
+          return false;
+      }
+      return true;
+    }
+
+    // One record batch: an encapsulated Message whose header is a RecordBatch,
+    // followed by its body. Every column is a validity and a values buffer.
+    bool batch(const std::string &path, int64_t offset, int32_t metadata, int64_t body) {
+      auto malformed = [&]() {
+        printf("Record batch at %lld of %s is malformed\n", (long long)offset, path.c_str());
+        return false;
+      };
+      if (offset < 0 || metadata < 8 || body < 0 || !this->in_file(offset, (uint64_t)metadata + body))
+        return malformed();
+      auto data = file.data() + offset;
+      // a continuation marker, since format 0.15, then the length of the flatbuffer
+      uint32_t marker;
+      memcpy(&marker, data, 4);
+      size_t skip = marker == 0xffffffffu ? 8 : 4;
+      Flat message, batch;
+      size_t nodes, buffers;
+      uint32_t node_count, buffer_count;
+      if (!Flat::root(data + skip, metadata - skip, message) || message.scalar<uint8_t>(1, 0) != 3 ||
+          !message.table(2, batch) || !batch.vector(1, 16, nodes, node_count) ||
+          !batch.vector(2, 16, buffers, buffer_count) ||
+          node_count != _fields.size() || buffer_count != 2 * _fields.size())
+        return malformed();
+      Flat compression;
+      if (batch.table(3, compression)) {
+        printf("Compressed record batches of %s are not supported\n", path.c_str());
+        return false;
+      }
+      Chunk chunk { (size_t)batch.scalar<int64_t>(0, 0), {} };
+      for (size_t k = 0; k < _fields.size(); k++) {
+        // FieldNode { int64 length; int64 null_count; }, Buffer { int64 offset; int64 length; }
+        int64_t nulls, start, length;
+        if (!batch.read(nodes + 16 * k + 8, nulls) || !batch.read(buffers + 16 * (2 * k + 1), start) ||
+            !batch.read(buffers + 16 * (2 * k + 1) + 8, length))
+          return malformed();
+        if (nulls) {
+          printf("Column '%s' of %s has nulls\n", _fields[k].name.c_str(), path.c_str());
+          return false;
+        }
+        if (start < 0 || length < 0 || start > body || length > body - start || (uint64_t)length / 8 < chunk.rows ||
+            (offset + metadata + start) % 8)
+          return malformed();
+        chunk.columns.push_back(data + metadata + start);
+      }
+      _rows += chunk.rows;
+      _chunks.push_back(std::move(chunk));
+      return true;
+    }
+
+   public:
+    // Reads a columnar file or an Arrow IPC file, told apart by their magic.
+    bool open(const std::string &path) {
+      if (!file.open(path))
+        return false;
+      if (file.size() >= 8 && !memcmp(file.data(), magic, 8))
+        return this->columnar(path);
+      if (file.size() >= 8 && !memcmp(file.data(), arrow_magic, 6))
+        return this->arrow(path);
+      printf("%s is neither a columnar nor an Arrow file\n", path.c_str());
+      return false;
+    }
+
+    const std::vector<Field> &fields() const {
+      return _fields;
+    }
+
+    const std::vector<Chunk> &chunks() const {
+      return _chunks;
+    }
+
+    size_t rows() const {
+      return _rows;
+    }
+
+    // The index of the column called name, or -1.
+    int find(const std::string &name) const {
+      for (size_t k = 0; k < _fields.size(); k++)
+        if (_fields[k].name == name)
+          return k;
+      return -1;
+    }
+  };
+
+  // Creates a columnar file of float64 columns called names, rows long, and
+  // maps it, so that results can be written straight into column(k).
+  class Writer {
+    Mapping file;
+    std::vector<double*> _columns;
+
+   public:
+    bool create(const std::string &path, const std::vector<std::string> &names, size_t rows) {
+      size_t offset = align(sizeof(Header) + names.size() * sizeof(Descriptor));
+      if (!file.create(path, offset + names.size() * align(rows * 8)))
+        return false;
+      Header header;
+      memcpy(header.magic, magic, 8);
+      header.version = 1;
+      header.columns = names.size();
+      header.rows = rows;
+      memcpy(file.data(), &header, sizeof(header));
+      for (size_t k = 0; k < names.size(); k++) {
+        Descriptor column {};
+        if (names[k].length() >= sizeof(column.name)) {
+          printf("Column name '%s' is too long\n", names[k].c_str());
+          return false;
+        }
+        memcpy(column.name, names[k].data(), names[k].length());
+        column.type = Float64;
+        column.offset = offset + k * align(rows * 8);
+        memcpy(file.data() + sizeof(header) + k * sizeof(column), &column, sizeof(column));
+        _columns.push_back((double*)(file.data() + column.offset));
+      }
+      return true;
+    }
+
+    double *column(size_t k) const {
+      return _columns[k];
+    }
+  };
+
+  // Rows converted or filled per pass, for the inputs that are not float64
+  // columns; only these take memory beyond the mappings.
+  const size_t stride = 1 << 16;
+
+  // Evaluates kernel(columns, rows, out), anything with the signature of
+  // batch::eval or llir::BatchKernel, over every row of table and writes the
+  // results to a columnar file at path with one column called result. Slot
+  // k of the kernel reads the column called variables[k], or the constant
+  // values[k] if there is one. Float64 columns are read in place; int64 ones
+  // are converted to doubles a stride at a time, exactly below 2**53.
+  template<typename K>
+  bool eval(K kernel, const Table &table, const parser::Variables &variables, const std::vector<double> &values,
+      const std::string &path) {
+    std::vector<int> index(variables.size(), -1);
+    for (size_t slot = values.size(); slot < variables.size(); slot++)
+      if ((index[slot] = table.find(variables[slot])) < 0) {
+        printf("No column '%s'\n", variables[slot].c_str());
+        return false;
+      }
+    Writer writer;
+    if (!writer.create(path, { "result" }, table.rows()))
+      return false;
+    double *out = writer.column(0);
+    std::vector<std::vector<double>> scratch(variables.size());
+    std::vector<const double*> columns(variables.size());
+    for (size_t slot = 0; slot < variables.size(); slot++)
+      if (index[slot] < 0)
+        scratch[slot].assign(stride, values[slot]);
+      else if (table.fields()[index[slot]].type == Int64)
+        scratch[slot].resize(stride);
+    for (auto &chunk : table.chunks())
+      for (size_t row = 0; row < chunk.rows; row += stride) {
+        size_t n = std::min(stride, chunk.rows - row);
+        for (size_t slot = 0; slot < variables.size(); slot++) {
+          if (index[slot] < 0) {
+            columns[slot] = scratch[slot].data();
+            continue;
+          }
+          auto column = chunk.columns[index[slot]];
+          if (table.fields()[index[slot]].type == Float64) {
+            columns[slot] = (const double*)column + row;
+            continue;
+          }
+          auto integers = (const int64_t*)column + row;
+          for (size_t i = 0; i < n; i++)
+            scratch[slot][i] = (double)integers[i];
+          columns[slot] = scratch[slot].data();
+        }
+        kernel(columns.data(), n, out);
+        out += n;
+      }
+    return true;
+  }
+}
@@ -0,0 +1,593 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "parser.h"
+
+// Formulas fixed at build time, parsed by the C++ compiler rather than at run
+// time: FORMULA("x * 2 + sin(y)") is an object whose type is the expression,
+// so a call to it inlines into plain arithmetic. The grammar, the precedence
+// and arity packed into the operator and function ids, and the results are
+// those of parse_infix, shunting_yard and the interpreter. Needs C++17.
+namespace formula {
+  namespace Operator = parser::Operator;
+  namespace Function = parser::Function;
+
+  // Not constexpr: parsing reaches one only for text that does not parse,
+  // which stops the build with the function's name as the message.
+  namespace error {
+    inline void invalid_character() {}
+    inline void parentheses_are_mismatched() {}
+    inline void separator_outside_function() {}
+    inline void syntax_error() {}
+  }
+
+  enum class Kind { Value, Variable, Operator, Function };
+
+  struct Node {
+    Kind kind = Kind::Value;
+    double value = 0;
+    // false for a literal that is converted at startup instead, spelled at
+    // [begin, end) of the text
+    bool exact = true;
+    size_t begin = 0, end = 0;
+    unsigned int slot = 0;
+    Operator::Type operator_ = Operator::Noop;
+    Function::Type function = Function::Pass;
+    int argc = 0;
+    // the first node of the subtree that computes this one
+    size_t first = 0;
+  };
+
+  struct Name {
+    size_t begin = 0, length = 0;
+  };
+
+  // A postfix program with room for n nodes, which text of n - 1 characters
+  // never needs more than.
+  template<size_t n>
+  struct Program {
+    Node code[n];
+    size_t size = 0;
+    Name names[n];
+    unsigned int slots = 0;
+  };
+
+  namespace {
+    constexpr bool is_space(char c) {
+      return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    constexpr bool is_digit(char c) {
+      return c >= '0' && c <= '9';
+    }
+
+    constexpr bool is_alpha(char c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    constexpr char lower(char c) {
+      return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    constexpr size_t length(const char *text) {
+      size_t n = 0;
+      while (text[n])
+        n++;
+      return n;
+    }
+
+    constexpr bool same(const char *a, size_t n, const char *b, bool fold) {
+      for (size_t i = 0; i < n; i++)
+        if (!b[i] || (fold ? lower(a[i]) != b[i] : a[i] != b[i]))
+          return false;
+      return !b[n];
+    }
+
+    // As token_to_operator spells them.
+    constexpr Operator::Type single(char c) {
+      switch (c) {
+        case ',': return Operator::Sep;
+        case '&': return Operator::And;
+        case '|': return Operator::Or;
+        case '^': return Operator::Xor;
+        case '+': return Operator::Add;
+        case '-': return Operator::Sub;
+        case '*': return Operator::Mul;
+        case '/': return Operator::Div;
+        case '%': return Operator::Rem;
+        case '~': return Operator::Not;
+        case '(': return Operator::Lbr;
+        case ')': return Operator::Rbr;
+        default:  return Operator::Noop;
+      }
+    }
+
+    constexpr Operator::Type twice(char c) {
+      switch (c) {
+        case '*': return Operator::Exp;
+        case '>': return Operator::Rsh;
+        case '<': return Operator::Lsh;
+        default:  return Operator::Noop;
+      }
+    }
+
+    // As token_to_function spells them.
+    struct Spelling {
+      const char *name;
+      Function::Type function;
+    };
+
+    constexpr Spelling functions[] = {
+      {"abs",   Function::Abs},   {"acos",  Function::Acos},  {"acosh", Function::Acosh},
+      {"asin",  Function::Asin},  {"asinh", Function::Asinh}, {"atan",  Function::Atan},
+      {"atanh", Function::Atanh}, {"atan2", Function::Atan2}, {"cbrt",  Function::Cbrt},
+      {"ceil",  Function::Ceil},  {"cos",   Function::Cos},   {"cosh",  Function::Cosh},
+      {"exp",   Function::Exp},   {"floor", Function::Floor}, {"round", Function::Round},
+      {"hypot", Function::Hypot}, {"log",   Function::Log},   {"log2",  Function::Log2},
+      {"log10", Function::Log10}, {"max",   Function::Max},   {"min",   Function::Min},
+      {"pow",   Function::Pow},   {"sin",   Function::Sin},   {"sinh",  Function::Sinh},
+      {"sqrt",  Function::Sqrt},  {"tan",   Function::Tan},   {"tanh",  Function::Tanh},
+      {"trunc", Function::Trunc}
+    };
+
+    // Scans the grammar of scan_number. Literals whose digits fit a double and
+    // whose power of ten is exact convert with one correctly rounded multiply
+    // or divide, as strtod would; any other is left for strtod at startup.
+    constexpr size_t number(const char *text, size_t p, size_t end, Node &out) {
+      size_t begin = p;
+      uint64_t digits = 0;
+      int exponent = 0;
+      bool exact = true;
+      auto digit = [&](char c, bool fraction) {
+        if (digits <= ((1ull << 53) - 9) / 10) {
+          digits = digits * 10 + (c - '0');
+          exponent -= fraction;
+        } else if (c != '0' || !fraction)
+          exact = false;
+      };
+      if (p < end && is_digit(text[p])) {
+        for (; p < end && is_digit(text[p]); p++)
+          digit(text[p], false);
+        if (p < end && text[p] == '.')
+          for (p++; p < end && is_digit(text[p]); p++)
+            digit(text[p], true);
+      } else if (p + 1 < end && text[p] == '.' && is_digit(text[p + 1])) {
+        for (p++; p < end && is_digit(text[p]); p++)
+          digit(text[p], true);
+      } else return begin;
+      if (p < end && (text[p] == 'e' || text[p] == 'E')) {
+        size_t q = p + 1;
+        bool negative = q < end && text[q] == '-';
+        if (q < end && (text[q] == '+' || text[q] == '-'))
+          q++;
+        if (q < end && is_digit(text[q])) {
+          int power = 0;
+          for (; q < end && is_digit(text[q]); q++)
+            power = power < 10000 ? power * 10 + (text[q] - '0') : power;
+          exponent += negative ? -power : power;
+          p = q;
+        }
+      }
+      double scale = 1;
+      for (int i = 0; i < (exponent < 0 ? -exponent : exponent) && i <= 22; i++)
+        scale *= 10;
+      out.kind = Kind::Value;
+      out.exact = exact && (!digits || (exponent >= -22 && exponent <= 22));
+      out.value = !digits ? 0 : exponent < 0 ? digits / scale : digits * scale;
+      out.begin = begin;
+      out.end = p;
+      return p;
+    }
+
+    constexpr size_t identifier(const char *text, size_t p, size_t end) {
+      if (p >= end || (!is_alpha(text[p]) && text[p] != '_'))
+        return p;
+      for (p++; p < end && (is_alpha(text[p]) || is_digit(text[p]) || text[p] == '_'); p++);
+      return p;
+    }
+
+    constexpr Node operator_node(Operator::Type op) {
+      Node node;
+      node.kind = Kind::Operator;
+      node.operator_ = op;
+      return node;
+    }
+
+    // parse_infix, into infix.
+    template<size_t n>
+    constexpr size_t tokenize(const char *text, Node (&infix)[n], Program<n> &program) {
+      size_t size = 0, end = length(text);
+      for (size_t p = 0, q = 0; p < end; p = q) {
+        Node node;
+        char c = text[p];
+        bool doubled = p + 1 < end && text[p + 1] == c && twice(c) != Operator::Noop;
+        Operator::Type op = doubled ? twice(c) : single(c);
+        if ((q = number(text, p, end, node)) != p)
+          infix[size++] = node;
+        else if (op != Operator::Noop) {
+          q = p + (doubled ? 2 : 1);
+          Node last;
+          if (size)
+            last = infix[size - 1];
+          if ((!size || (last.kind != Kind::Value && last.kind != Kind::Variable &&
+                         !(last.kind == Kind::Operator && last.operator_ == Operator::Rbr))) &&
+              (op == Operator::Add || op == Operator::Sub))
+            op = op == Operator::Add ? Operator::Pos : Operator::Neg;
+          if (size && last.kind == Kind::Function)
+            op = Operator::Fn;
+          infix[size++] = operator_node(op);
+        } else if ((q = identifier(text, p, end)) != p) {
+          size_t r = q;
+          while (r < end && is_space(text[r]))
+            r++;
+          bool found = false;
+          if (r < end && text[r] == '(')
+            for (auto &spelling : functions)
+              if (!found && same(text + p, q - p, spelling.name, true)) {
+                node.kind = Kind::Function;
+                node.function = spelling.function;
+                found = true;
+              }
+          if (!found && (same(text + p, q - p, "pi", true) || same(text + p, q - p, "e", true))) {
+            node.value = same(text + p, q - p, "pi", true) ? M_PI : M_E;
+            found = true;
+          }
+          if (!found) {
+            node.kind = Kind::Variable;
+            node.slot = program.slots;
+            for (unsigned int k = program.slots; k-- > 0;)
+              if (std::string_view(text + program.names[k].begin, program.names[k].length) ==
+                  std::string_view(text + p, q - p))
+                node.slot = k;
+            if (node.slot == program.slots)
+              program.names[program.slots++] = { p, q - p };
+          }
+          infix[size++] = node;
+        } else {
+          for (q = p; q < end && is_space(text[q]); q++);
+          if (q == p) {
+            error::invalid_character();
+            return 0;
+          }
+        }
+      }
+      return size;
+    }
+
+    // shunting_yard and Program::create, into program.
+    template<size_t n>
+    constexpr Program<n> parse(const char *text) {
+      Program<n> program {};
+      Node infix[n] {};
+      size_t size = tokenize(text, infix, program);
+      Operator::Type operators[n] {};
+      Node calls[n] {};
+      size_t ops = 0, fns = 0;
+      auto &out = program.code;
+      auto emit = [&](const Node &node) { out[program.size++] = node; };
+      for (size_t i = 0; i < size; i++) {
+        auto &token = infix[i];
+        if (token.kind == Kind::Value || token.kind == Kind::Variable) {
+          if (fns && !calls[fns - 1].argc)
+            calls[fns - 1].argc++;
+          emit(token);
+        } else if (token.kind == Kind::Function) {
+          if (fns && !calls[fns - 1].argc)
+            calls[fns - 1].argc++;
+          calls[fns++] = token;
+        } else if (Operator::sentinel(token.operator_))
+          operators[ops++] = token.operator_;
+        else if (token.operator_ == Operator::Rbr) {
+          while (true) {
+            if (!ops) {
+              error::parentheses_are_mismatched();
+              return program;
+            }
+            auto op = operators[--ops];
+            if (op == Operator::Fn) {
+              emit(calls[--fns]);
+              break;
+            } else if (op == Operator::Lbr)
+              break;
+            emit(operator_node(op));
+          }
+        } else {
+          if (Operator::arity(token.operator_) != 1)
+            while (ops && !Operator::sentinel(operators[ops - 1]) &&
+                   Operator::precedence(token.operator_) <= Operator::precedence(operators[ops - 1]))
+              emit(operator_node(operators[--ops]));
+          if (token.operator_ != Operator::Sep)
+            operators[ops++] = token.operator_;
+          else if (!fns) {
+            error::separator_outside_function();
+            return program;
+          } else calls[fns - 1].argc++;
+        }
+      }
+      while (ops) {
+        if (Operator::sentinel(operators[ops - 1])) {
+          error::parentheses_are_mismatched();
+          return program;
+        }
+        emit(operator_node(operators[--ops]));
+      }
+      if (fns) {
+        error::syntax_error();
+        return program;
+      }
+      // every node must find its operands, and one value must be left
+      size_t starts[n] {}, depth = 0;
+      for (size_t i = 0; i < program.size; i++) {
+        auto &node = out[i];
+        size_t operands = node.kind == Kind::Operator ? Operator::arity(node.operator_) :
+          node.kind == Kind::Function ? node.argc : 0;
+        if (operands > depth ||
+            (node.kind == Kind::Function && Function::arity(node.function) > (int)operands)) {
+          error::syntax_error();
+          return program;
+        }
+        depth -= operands;
+        node.first = operands ? starts[depth] : i;
+        starts[depth++] = node.first;
+      }
+      if (depth != 1)
+        error::syntax_error();
+      return program;
+    }
+
+    // The node that computes operand k of node i.
+    template<size_t n>
+    constexpr size_t operand(const Program<n> &program, size_t i, size_t k) {
+      auto &node = program.code[i];
+      size_t operands = node.kind == Kind::Operator ? Operator::arity(node.operator_) : node.argc;
+      size_t at = i - 1;
+      for (size_t m = operands - 1; m > k; m--)
+        at = program.code[at].first - 1;
+      return at;
+    }
+
+    // Bit operators keep integers, as in the interpreter and the JIT.
+    inline int64_t integer(int64_t x) {
+      return x;
+    }
+
+    inline int64_t integer(double x) {
+      return Operator::integer(x);
+    }
+
+    inline double real(double x) {
+      return x;
+    }
+
+    inline double real(int64_t x) {
+      return (double)x;
+    }
+
+    template<Function::Type fn>
+    inline double call() {
+      return 0;
+    }
+
+    template<Function::Type fn>
+    inline double call(double a) {
+      switch (fn) {
+        case Function::Abs:   return std::abs(a);
+        case Function::Acos:  return std::acos(a);
+        case Function::Acosh: return std::acosh(a);
+        case Function::Asin:  return std::asin(a);
+        case Function::Asinh: return std::asinh(a);
+        case Function::Atan:  return std::atan(a);
+        case Function::Atanh: return std::atanh(a);
+        case Function::Cbrt:  return std::cbrt(a);
+        case Function::Ceil:  return std::ceil(a);
+        case Function::Cos:   return std::cos(a);
+        case Function::Cosh:  return std::cosh(a);
+        case Function::Exp:   return std::exp(a);
+        case Function::Floor: return std::floor(a);
+        case Function::Log:   return std::log(a);
+        case Function::Log10: return std::log10(a);
+        case Function::Log2:  return std::log2(a);
+        case Function::Round: return std::round(a);
+        case Function::Sin:   return std::sin(a);
+        case Function::Sinh:  return std::sinh(a);
+        case Function::Sqrt:  return std::sqrt(a);
+        case Function::Tan:   return std::tan(a);
+        case Function::Tanh:  return std::tanh(a);
+        case Function::Trunc: return std::trunc(a);
+        default:              return a;
+      }
+    }
+
+    template<Function::Type fn>
+    inline double call(double a, double b) {
+      switch (fn) {
+        case Function::Atan2: return std::atan2(a, b);
+        case Function::Pow:   return std::pow(a, b);
+        case Function::Hypot: return std::hypot(a, b);
+        case Function::Max:   return Function::max(a, b);
+        case Function::Min:   return Function::min(a, b);
+        default:              return a;
+      }
+    }
+
+    // hypot, max and min of more arguments reduce as the interpreter does
+    template<Function::Type fn, typename... Rest>
+    inline double call(double a, double b, double c, Rest... rest) {
+      double x[] = { a, b, c, (double)rest... };
+      if (fn == Function::Hypot)
+        return Function::hypot(x, sizeof(x) / sizeof(x[0]));
+      return Function::tree(x, sizeof(x) / sizeof(x[0]), fn == Function::Max ? Function::max : Function::min);
+    }
+  }
+
+  // The nodes of an expression: each is a type whose eval reads input slot k
+  // from vars[k] and returns a double, or an int64_t from a bit operator.
+  template<unsigned int slot>
+  struct Var {
+    static double eval(const double *vars) {
+      return vars[slot];
+    }
+  };
+
+  // Node i of P::program, a literal.
+  template<typename P, size_t i>
+  struct Constant {
+    static double eval(const double *) {
+      if constexpr (P::program.code[i].exact)
+        return P::program.code[i].value;
+      else
+        return converted;
+    }
+
+    static inline const double converted = strtod(std::string(P::text() + P::program.code[i].begin,
+      P::program.code[i].end - P::program.code[i].begin).c_str(), nullptr);
+  };
+
+  template<Operator::Type op, typename A>
+  struct Unary {
+    static auto eval(const double *vars) {
+      auto a = A::eval(vars);
+      if constexpr (op == Operator::Not)
+        return ~integer(a);
+      else if constexpr (op == Operator::Neg)
+        return -real(a);
+      else
+        return a;
+    }
+  };
+
+  template<Operator::Type op, typename A, typename B>
+  struct Binary {
+    static auto eval(const double *vars) {
+      auto a = A::eval(vars);
+      auto b = B::eval(vars);
+      if constexpr (op == Operator::And)
+        return integer(a) & integer(b);
+      else if constexpr (op == Operator::Or)
+        return integer(a) | integer(b);
+      else if constexpr (op == Operator::Xor)
+        return integer(a) ^ integer(b);
+      else if constexpr (op == Operator::Rsh)
+        return Operator::shift_right(integer(a), integer(b));
+      else if constexpr (op == Operator::Lsh)
+        return Operator::shift_left(integer(a), integer(b));
+      else if constexpr (op == Operator::Add)
+        return real(a) + real(b);
+      else if constexpr (op == Operator::Sub)
+        return real(a) - real(b);
+      else if constexpr (op == Operator::Mul)
+        return real(a) * real(b);
+      else if constexpr (op == Operator::Div)
+        return real(a) / real(b);
+      else if constexpr (op == Operator::Rem)
+        return fmod(real(a), real(b));
+      else
+        return pow(real(a), real(b));
+    }
+  };
+
+  template<Function::Type fn, typename... Args>
+  struct Call {
+    static double eval(const double *vars) {
+      return call<fn>(real(Args::eval(vars))...);
+    }
+  };
+
+  // The node type of node i of P::program.
+  template<typename P, size_t i, Kind kind = P::program.code[i].kind>
+  struct Build;
+
+  template<typename P, size_t i, typename Operands>
+  struct Apply;
+
+  template<typename P, size_t i>
+  using build = typename Build<P, i>::type;
+
+  template<typename P, size_t i, size_t... k>
+  struct Apply<P, i, std::index_sequence<k...>> {
+    static constexpr auto &node = P::program.code[i];
+
+    template<typename... Args>
+    static auto make(Args...) {
+      if constexpr (node.kind == Kind::Function)
+        return Call<node.function, Args...>();
+      else if constexpr (sizeof...(Args) == 1)
+        return Unary<node.operator_, Args...>();
+      else
+        return Binary<node.operator_, Args...>();
+    }
+
+    typedef decltype(make(build<P, operand(P::program, i, k)>()...)) type;
+  };
+
+  template<typename P, size_t i>
+  struct Build<P, i, Kind::Value> {
+    typedef Constant<P, i> type;
+  };
+
+  template<typename P, size_t i>
+  struct Build<P, i, Kind::Variable> {
+    typedef Var<P::program.code[i].slot> type;
+  };
+
+  template<typename P, size_t i>
+  struct Build<P, i, Kind::Operator> {
+    typedef typename Apply<P, i, std::make_index_sequence<Operator::arity(P::program.code[i].operator_)>>::type type;
+  };
+
+  // arguments past the arity are never read
+  template<typename P, size_t i>
+  struct Build<P, i, Kind::Function> {
+    static constexpr int arity = Function::arity(P::program.code[i].function);
+    static constexpr size_t argc = P::program.code[i].argc;
+
+    typedef typename Apply<P, i, std::make_index_sequence<arity >= 0 && (size_t)arity < argc ? arity : argc>>::type type;
+  };
+
+  // The program of the text T::text() returns.
+  template<typename T>
+  struct Parsed {
+    static constexpr const char *text() {
+      return T::text();
+    }
+
+    static constexpr auto program = parse<length(T::text()) + 1>(T::text());
+  };
+
+  // An expression of P::program.slots variables, numbered in order of first
+  // appearance.
+  template<typename P>
+  struct Formula {
+    typedef build<P, P::program.size - 1> tree;
+    static constexpr unsigned int slots = P::program.slots;
+
+    static constexpr std::string_view variable(unsigned int slot) {
+      return std::string_view(P::text() + P::program.names[slot].begin, P::program.names[slot].length);
+    }
+
+    double operator()(const double *vars) const {
+      return real(tree::eval(vars));
+    }
+
+    // One value per variable, in order.
+    template<typename... Args, typename = std::enable_if_t<(std::is_arithmetic<Args>::value && ...)>>
+    double operator()(Args... args) const {
+      static_assert(sizeof...(Args) == slots, "a formula takes one value per variable");
+      const double vars[] = { (double)args..., 0 };
+      return (*this)(vars);
+    }
+  };
+}
+
+// A formula of the string literal text, parsed while compiling.
+#define FORMULA(expr) ([]() { \
+    struct Text { static constexpr const char *text() { return expr; } }; \
+    return ::formula::Formula<::formula::Parsed<Text>>(); \
+  }())
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "parser.h"
+#include "stats.h"
+
+namespace incremental {
+  namespace {
+    using parser::Token;
+    namespace Operator = parser::Operator;
+    namespace Function = parser::Function;
+
+    inline int64_t bits(double x) {
+      int64_t i;
+      memcpy(&i, &x, sizeof(i));
+      return i;
+    }
+
+    inline double raw(int64_t i) {
+      double x;
+      memcpy(&x, &i, sizeof(x));
+      return x;
+    }
+  }
+
+  // Keeps the value of every node of a program between evaluations, so that
+  // when only some inputs change, only the nodes that depend on them are
+  // computed again; the cost of an update is that of the affected part of
+  // the DAG rather than of the whole expression. A node whose new value is
+  // the same as its old one stops the update there. Results agree with the
+  // bytecode interpreter. Programs from simplify share repeated
+  // subexpressions, and so share their values here; an evaluator is meant
+  // for one thread at a time.
+  class Evaluator {
+    // One node of the program's DAG. Its arguments and the nodes that read it
+    // are ranges of args and users. A bit operator keeps its result as an
+    // integer, in the same 8 bytes as a double.
+    struct Node {
+      Token token;
+      uint32_t args, argc;
+      uint32_t users, userc;
+      double value;
+      bool integer;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> args, users;
+    // the node of each input slot that is read, or -1
+    std::vector<uint32_t> inputs;
+    // the result, or one node per output of a fused program
+    std::vector<uint32_t> roots;
+    size_t _outputs = 0;
+    // nodes waiting to be computed, as a heap of their indices; nodes come
+    // after their arguments, so the smallest one is always ready
+    std::vector<uint32_t> pending;
+    std::vector<uint64_t> queued;
+    uint64_t generation = 1;
+    size_t _recomputed = 0;
+    // the arguments of a variadic call
+    std::vector<double> scratch;
+
+    void enqueue(uint32_t node) {
+      if (queued[node] == generation)
+        return;
+      queued[node] = generation;
+      pending.push_back(node);
+      std::push_heap(pending.begin(), pending.end(), std::greater<uint32_t>());
+    }
+
+    double real(uint32_t node) const {
+      auto &n = nodes[node];
+      return n.integer ? (double)bits(n.value) : n.value;
+    }
+
+    int64_t integer(uint32_t node) const {
+      auto &n = nodes[node];
+      return n.integer ? bits(n.value) : Operator::integer(n.value);
+    }
+
+    double arg(const Node &node, uint32_t i) const {
+      return this->real(args[node.args + i]);
+    }
+
+    // Computes node from the current values of its arguments.
+    void compute(Node &node) {
+      auto &token = node.token;
+      node.integer = false;
+      if (token.is_operator()) {
+        auto op = token.operator_();
+        if (Operator::bitwise(op)) {
+          int64_t a = this->integer(args[node.args]), b = node.argc > 1 ? this->integer(args[node.args + 1]) : 0, r;
+          switch (op) {
+            case Operator::And: r = a & b; break;
+            case Operator::Or:  r = a | b; break;
+            case Operator::Xor: r = a ^ b; break;
+            case Operator::Rsh: r = Operator::shift_right(a, b); break;
+            case Operator::Lsh: r = Operator::shift_left(a, b); break;
+            default:            r = ~a; break;
+          }
+          node.value = raw(r);
+          node.integer = true;
+          return;
+        }
+        double a = this->arg(node, 0), b = node.argc > 1 ? this->arg(node, 1) : 0;
+        switch (op) {
+          case Operator::Add: node.value = a + b; break;
+          case Operator::Sub: node.value = a - b; break;
+          case Operator::Mul: node.value = a * b; break;
+          case Operator::Div: node.value = a / b; break;
+          case Operator::Rem: node.value = fmod(a, b); break;
+          case Operator::Exp: node.value = pow(a, b); break;
+          case Operator::Neg: node.value = -a; break;
+          default:            node.value = a; break;
+        }
+        return;
+      }
+      auto fn = token.function();
+      if (Function::arity(fn) < 0) {
+        // variadic calls reduce as the interpreter does
+        scratch.resize(node.argc);
+        for (uint32_t i = 0; i < node.argc; i++)
+          scratch[i] = this->arg(node, i);
+        if (fn == Function::Hypot)
+          node.value = Function::hypot(scratch.data(), node.argc);
+        else
+          node.value = Function::tree(scratch.data(), node.argc, fn == Function::Max ? Function::max : Function::min);
+        return;
+      }
+      double a = this->arg(node, 0), b = node.argc > 1 ? this->arg(node, 1) : 0;
+      switch (fn) {
+        case Function::Abs:   node.value = std::abs(a); break;
+        case Function::Acos:  node.value = std::acos(a); break;
+        case Function::Acosh: node.value = std::acosh(a); break;
+        case Function::Asin:  node.value = std::asin(a); break;
+        case Function::Asinh: node.value = std::asinh(a); break;
+        case Function::Atan:  node.value = std::atan(a); break;
+        case Function::Atan2: node.value = std::atan2(a, b); break;
+        case Function::Atanh: node.value = std::atanh(a); break;
+        case Function::Cbrt:  node.value = std::cbrt(a); break;
+        case Function::Ceil:  node.value = std::ceil(a); break;
+        case Function::Cos:   node.value = std::cos(a); break;
+        case Function::Cosh:  node.value = std::cosh(a); break;
+        case Function::Exp:   node.value = std::exp(a); break;
+        case Function::Floor: node.value = std::floor(a); break;
+        case Function::Log:   node.value = std::log(a); break;
+        case Function::Log10: node.value = std::log10(a); break;
+        case Function::Log2:  node.value = std::log2(a); break;
+        case Function::Pow:   node.value = std::pow(a, b); break;
+        case Function::Round: node.value = std::round(a); break;
+        case Function::Sin:   node.value = std::sin(a); break;
+        case Function::Sinh:  node.value = std::sinh(a); break;
+        case Function::Sqrt:  node.value = std::sqrt(a); break;
+        case Function::Tan:   node.value = std::tan(a); break;
+        case Function::Tanh:  node.value = std::tanh(a); break;
+        default:              node.value = std::trunc(a); break;
+      }
+    }
+
+   public:
+    // Builds the DAG of program, with every input at 0 until reset(). out is
+    // left empty if program has a token the evaluator does not run.
+    static bool create(const parser::Program &program, Evaluator &out) {
+      out = Evaluator();
+      std::vector<uint32_t> stack, temps(program.temps());
+      // edges grouped by node, before they are packed into ranges
+      std::vector<std::vector<uint32_t>> readers;
+      out.inputs.assign(program.slots(), -1);
+      out.roots.resize(program.outputs());
+      out._outputs = program.outputs();
+      auto add = [&](Token token, uint32_t argc) {
+        Node node { token, (uint32_t)out.args.size(), argc, 0, 0, 0, false };
+        out.args.insert(out.args.end(), stack.end() - argc, stack.end());
+        stack.erase(stack.end() - argc, stack.end());
+        out.nodes.push_back(node);
+        readers.emplace_back();
+        stack.push_back(out.nodes.size() - 1);
+      };
+      for (auto &token : program.code()) {
+        if (token.is_store())
+          temps[token.temp()] = stack.back();
+        else if (token.is_load())
+          stack.push_back(temps[token.temp()]);
+        else if (token.is_output()) {
+          out.roots[token.output()] = stack.back();
+          stack.pop_back();
+        } else if (token.is_variable()) {
+          // every read of a slot is one node, so a change is queued once
+          auto &input = out.inputs[token.slot()];
+          if (input == (uint32_t)-1) {
+            add(token, 0);
+            input = stack.back();
+          } else stack.push_back(input);
+        } else if (token.is_value())
+          add(token, 0);
+        else if (token.operator_() == Operator::Pos)
+          continue;
+        else if (token.is_operator())
+          add(token, token.operator_arity());
+        else if (token.is_function()) {
+          int argc = token.function_argc(), arity = token.function_arity();
+          // arguments past the arity are never read, so nothing depends on them
+          if (arity >= 0 && argc > arity)
+            stack.resize(stack.size() - (argc - arity));
+          add(token, arity >= 0 ? std::min(argc, arity) : argc);
+        } else {
+          printf("Unsupported token '%s'\n", token.to_string().c_str());
+          out = Evaluator();
+          return false;
+        }
+      }
+      if (!out._outputs)
+        out.roots.push_back(stack.back());
+      for (uint32_t i = 0; i < out.nodes.size(); i++) {
+        auto &node = out.nodes[i];
+        for (uint32_t k = 0; k < node.argc; k++) {
+          auto &r = readers[out.args[node.args + k]];
+          // f(x, x) reads x once as far as updates go
+          if (r.empty() || r.back() != i)
+            r.push_back(i);
+        }
+      }
+      for (uint32_t i = 0; i < out.nodes.size(); i++) {
+        out.nodes[i].users = out.users.size();
+        out.nodes[i].userc = readers[i].size();
+        out.users.insert(out.users.end(), readers[i].begin(), readers[i].end());
+      }
+      out.queued.assign(out.nodes.size(), 0);
+      std::vector<double> zeros(program.slots());
+      out.reset(zeros.data());
+      return true;
+    }
+
+    // Sets every input slot to vars and computes the whole program afresh.
+    void reset(const double *vars) {
+      stats::Timer timer(stats::Eval);
+      for (auto &node : nodes) {
+        if (node.token.is_value()) {
+          node.value = node.token.value();
+          node.integer = false;
+        } else if (node.token.is_variable()) {
+          node.value = vars[node.token.slot()];
+          node.integer = false;
+        } else this->compute(node);
+      }
+      _recomputed = nodes.size();
+      pending.clear();
+      generation++;
+    }
+
+    // Changes input slot; the change is computed by the next update(). A
+    // slot the program does not read, or set to the value it has, costs
+    // nothing.
+    void set(unsigned int slot, double value) {
+      if (slot >= inputs.size() || inputs[slot] == (uint32_t)-1)
+        return;
+      auto &node = nodes[inputs[slot]];
+      if (bits(node.value) == bits(value))
+        return;
+      node.value = value;
+      for (uint32_t k = 0; k < node.userc; k++)
+        this->enqueue(users[node.users + k]);
+    }
+
+    // Computes again every node that depends on a slot changed since the last
+    // update, in order, and returns how many nodes that took.
+    size_t update() {
+      stats::Timer timer(stats::Eval);
+      size_t count = 0;
+      while (!pending.empty()) {
+        std::pop_heap(pending.begin(), pending.end(), std::greater<uint32_t>());
+        auto &node = nodes[pending.back()];
+        pending.pop_back();
+        double before = node.value;
+        bool integer = node.integer;
+        this->compute(node);
+        count++;
+        if (bits(before) == bits(node.value) && integer == node.integer)
+          continue;
+        for (uint32_t k = 0; k < node.userc; k++)
+          this->enqueue(users[node.users + k]);
+      }
+      generation++;
+      _recomputed = count;
+      return count;
+    }
+
+    // Sets the slots that differ from vars and updates.
+    size_t update(const double *vars) {
+      for (unsigned int slot = 0; slot < inputs.size(); slot++)
+        this->set(slot, vars[slot]);
+      return this->update();
+    }
+
+    // The result as of the last update.
+    double result() const {
+      return roots.empty() ? 0 : this->real(roots[0]);
+    }
+
+    // Output k of a fused program as of the last update.
+    double output(size_t k) const {
+      return this->real(roots[k]);
+    }
+
+    size_t outputs() const {
+      return _outputs;
+    }
+
+    size_t size() const {
+      return nodes.size();
+    }
+
+    // nodes computed by the last reset or update
+    size_t recomputed() const {
+      return _recomputed;
+    }
+  };
+}
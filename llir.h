@@ -0,0 +1,1041 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+#include <llvm-c/Core.h>
+#include <llvm/Analysis/VectorUtils.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/NoFolder.h>
+#include <llvm/IR/Type.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Object/ArchiveWriter.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FileUtilities.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+
+#include "parser.h"
+#include "stats.h"
+
+namespace llir {
+  // A JIT-compiled expression; reads one value per input slot from vars.
+  typedef double (*Kernel)(const double *vars);
+
+  // A JIT-compiled batch loop: evaluates the expression for rows rows, reading
+  // columns[slot][row] and writing out[row]. The compiled code keeps no state
+  // and may run on any number of threads, e.g. through batch::parallel.
+  typedef void (*BatchKernel)(const double *const *columns, size_t rows, double *out);
+
+  // A JIT-compiled fused program: writes output k of the row in vars to out[k].
+  typedef void (*FusedKernel)(const double *vars, double *out);
+
+  // A JIT-compiled batch loop over a fused program: writes output k of each
+  // row to out[k][row], loading the inputs of a row once for all outputs. The
+  // outputs must not overlap the input columns.
+  typedef void (*FusedBatchKernel)(const double *const *columns, size_t rows, double *const *out);
+
+  // Owns the code of a kernel compiled with one: Tracker::remove() unloads it,
+  // after which the kernel must not be called any more.
+  typedef llvm::orc::ResourceTrackerSP Tracker;
+
+  // What ahead-of-time code is compiled for: an LLVM target triple, a CPU as
+  // for -mcpu and features as for -mattr (+avx2,-fma). An empty triple means
+  // the host, and then an empty CPU and features mean the host's own; a CPU
+  // brings its own features, which features then change.
+  struct Target {
+    std::string triple, cpu, features;
+  };
+
+  namespace {
+    // The libm function each function is lowered to, with its argument count.
+    const std::map<parser::Function::Type, std::pair<std::string, int>> ir_math {
+      {parser::Function::Abs,   {"fabs",  1}},
+      {parser::Function::Acos,  {"acos",  1}},
+      {parser::Function::Acosh, {"acosh", 1}},
+      {parser::Function::Asin,  {"asin",  1}},
+      {parser::Function::Asinh, {"asinh", 1}},
+      {parser::Function::Atan,  {"atan",  1}},
+      {parser::Function::Atanh, {"atanh", 1}},
+      {parser::Function::Atan2, {"atan2", 2}},
+      {parser::Function::Cbrt,  {"cbrt",  1}},
+      {parser::Function::Ceil,  {"ceil",  1}},
+      {parser::Function::Cos,   {"cos",   1}},
+      {parser::Function::Cosh,  {"cosh",  1}},
+      {parser::Function::Exp,   {"exp",   1}},
+      {parser::Function::Floor, {"floor", 1}},
+      {parser::Function::Hypot, {"hypot", 2}},
+      {parser::Function::Log,   {"log",   1}},
+      {parser::Function::Log2,  {"log2",  1}},
+      {parser::Function::Log10, {"log10", 1}},
+      {parser::Function::Max,   {"fmax",  2}},
+      {parser::Function::Min,   {"fmin",  2}},
+      {parser::Function::Pow,   {"pow",   2}},
+      {parser::Function::Round, {"round", 1}},
+      {parser::Function::Sin,   {"sin",   1}},
+      {parser::Function::Sinh,  {"sinh",  1}},
+      {parser::Function::Sqrt,  {"sqrt",  1}},
+      {parser::Function::Tan,   {"tan",   1}},
+      {parser::Function::Tanh,  {"tanh",  1}},
+      {parser::Function::Trunc, {"trunc", 1}}
+    };
+
+    // Functions the target has instructions or short sequences for, lowered
+    // to intrinsics in fast mode so that LLVM folds and vectorizes them as it
+    // does arithmetic; the others stay libm calls, which libmvec vectorizes.
+    // max and min are intrinsics in every mode.
+    const std::map<parser::Function::Type, llvm::Intrinsic::ID> ir_intrinsics {
+      {parser::Function::Abs,   llvm::Intrinsic::fabs},
+      {parser::Function::Ceil,  llvm::Intrinsic::ceil},
+      {parser::Function::Floor, llvm::Intrinsic::floor},
+      {parser::Function::Round, llvm::Intrinsic::round},
+      {parser::Function::Sqrt,  llvm::Intrinsic::sqrt},
+      {parser::Function::Trunc, llvm::Intrinsic::trunc}
+    };
+
+    // The functions glibc's libmvec has vector variants of, with their
+    // argument counts; the float variants are named with an f as in libm.
+    const std::map<std::string, unsigned int> vector_math {
+      {"acos",  1}, {"acosh", 1}, {"asin",  1}, {"asinh", 1}, {"atan",  1},
+      {"atan2", 2}, {"atanh", 1}, {"cbrt",  1}, {"cos",   1}, {"cosh",  1},
+      {"exp",   1}, {"hypot", 2}, {"log",   1}, {"log10", 1}, {"log2",  1},
+      {"pow",   2}, {"sin",   1}, {"sinh",  1}, {"tan",   1}, {"tanh",  1}
+    };
+
+    // Changes whenever the same program starts to compile to code that means
+    // something else, so that object code kept by an older build is not linked.
+    const unsigned int object_format = 2;
+
+    // Appends everything the code of program depends on to key, through the
+    // accessors, since the rest of a token is left uninitialized.
+    void serialize(const parser::Program &program, std::string &key) {
+      auto append = [&](const void *data, size_t size) { key.append((const char*)data, size); };
+      size_t sizes[] = { program.code().size(), program.slots(), program.temps() };
+      append(sizes, sizeof(sizes));
+      for (auto &token : program.code()) {
+        double value = token.value();
+        int fields[] = {
+          token.is_value() | token.is_variable() << 1 | token.is_store() << 2 | token.is_load() << 3 |
+            token.is_output() << 4,
+          token.operator_(), token.function(), token.function_argc(), (int)token.slot(), (int)token.temp(),
+          (int)token.output()
+        };
+        append(&value, sizeof(value));
+        append(fields, sizeof(fields));
+      }
+    }
+
+    // Kernels of fused programs have signatures of their own.
+    bool check(const parser::Program &program, bool fused) {
+      if (!program.outputs() == !fused)
+        return true;
+      printf(fused ? "Program has a single result\n" : "Program is fused\n");
+      return false;
+    }
+
+    bool report(llvm::Error error) {
+      printf("LLVM error: %s\n", llvm::toString(std::move(error)).c_str());
+      return false;
+    }
+
+    // The libmvec ISAs the host can run, widest first: the letter of the
+    // vector function ABI and the number of doubles per vector.
+    std::vector<std::pair<char, unsigned int>> vector_isas() {
+      llvm::StringMap<bool> features;
+      llvm::sys::getHostCPUFeatures(features);
+      std::vector<std::pair<char, unsigned int>> isas;
+      if (features.lookup("avx512f"))
+        isas.push_back({ 'e', 8 });
+      if (features.lookup("avx2"))
+        isas.push_back({ 'd', 4 });
+      isas.push_back({ 'b', 2 });
+      return isas;
+    }
+
+    // Keeps object code on disk for the modules that ask for it: those named
+    // after the path of their object file. Anything else is compiled as usual.
+    struct ObjectStore : llvm::ObjectCache {
+      static bool wants(const llvm::Module *module) {
+        return llvm::StringRef(module->getModuleIdentifier()).endswith(".o");
+      }
+
+      void notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef object) override {
+        if (!wants(module))
+          return;
+        // written under another name and renamed, so that another process
+        // never maps a file that is only half written
+        auto &path = module->getModuleIdentifier();
+        if (auto error = llvm::writeFileAtomically(path + ".%%%%%%", path, object.getBuffer()))
+          report(std::move(error));
+      }
+
+      std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module) override {
+        if (!wants(module))
+          return nullptr;
+        auto buffer = llvm::MemoryBuffer::getFile(module->getModuleIdentifier(), false, false);
+        return buffer ? std::move(*buffer) : nullptr;
+      }
+    };
+
+    // What every compiler shares: the native target, set up once, and the JIT
+    // that all kernels are loaded into. ORC is thread-safe, and each compile
+    // gets a target machine of its own, so compilers on different threads
+    // never wait for each other.
+    struct Shared {
+      std::unique_ptr<llvm::orc::LLJIT> session;
+      // whether libmvec could be loaded for vectorized math calls
+      bool libmvec = false;
+      std::atomic<unsigned int> kernels { 0 };
+      ObjectStore objects;
+      std::mutex lock;
+
+      bool init() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (session)
+          return true;
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        auto jit = llvm::orc::LLJITBuilder()
+          .setCompileFunctionCreator([this](llvm::orc::JITTargetMachineBuilder machine)
+              -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+            return std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(machine), &objects);
+          })
+          .create();
+        if (!jit)
+          return report(jit.takeError());
+        auto prefix = (*jit)->getDataLayout().getGlobalPrefix();
+        // let compiled code call into libm and the rest of this process
+        auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix);
+        if (!generator)
+          return report(generator.takeError());
+        (*jit)->getMainJITDylib().addGenerator(std::move(*generator));
+        auto mvec = llvm::orc::DynamicLibrarySearchGenerator::Load("libmvec.so.1", prefix);
+        if (mvec) {
+          (*jit)->getMainJITDylib().addGenerator(std::move(*mvec));
+          libmvec = true;
+        } else llvm::consumeError(mvec.takeError());
+        session = std::move(*jit);
+        return true;
+      }
+
+      // Every target LLVM was built with, for ahead-of-time compilation.
+      void all_targets() {
+        std::lock_guard<std::mutex> guard(lock);
+        static bool done = false;
+        if (done)
+          return;
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmPrinters();
+        done = true;
+      }
+    };
+    static Shared shared;
+  }
+
+  // Lowers programs to LLVM IR, either into main.ll or into the process-wide
+  // JIT. A compiler owns its LLVM context and the module being built, so it
+  // can be reused for any number of expressions, and compilers on different
+  // threads are independent; one compiler must not be used by two threads at
+  // once.
+  class Compiler {
+    std::unique_ptr<llvm::TargetMachine> host;
+    // the machine the current module is built for
+    llvm::TargetMachine *machine = nullptr;
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::IRBuilder<llvm::NoFolder>> builder;
+    std::unique_ptr<llvm::Module> module;
+    // functions declared in the current module, by name
+    std::map<std::string, llvm::Function*> declared;
+    // where object code is kept between runs, if anywhere
+    std::string directory;
+    parser::Math::Mode mode = parser::Math::Strict;
+
+    llvm::Type *t_char_ptr() { return llvm::Type::getInt8PtrTy(*context); }
+    llvm::Type *t_int32() { return llvm::Type::getInt32Ty(*context); }
+    llvm::Type *t_int64() { return llvm::Type::getInt64Ty(*context); }
+    llvm::Type *t_double() { return llvm::Type::getDoubleTy(*context); }
+    llvm::Type *t_double_ptr() { return llvm::Type::getDoublePtrTy(*context); }
+    // what expressions compute in; inputs and results are doubles either way
+    llvm::Type *t_real() {
+      return mode == parser::Math::Float32 ? llvm::Type::getFloatTy(*context) : t_double();
+    }
+
+    // Whether the machine the current module is built for, rather than the
+    // host, has 512-bit vectors.
+    bool avx512() {
+      return machine->getTargetTriple().isX86() && machine->getMCSubtargetInfo()->checkFeatures("+avx512f");
+    }
+
+    bool target() {
+      if (!shared.init())
+        return false;
+      if (host)
+        return true;
+      auto detected = llvm::orc::JITTargetMachineBuilder::detectHost();
+      if (!detected)
+        return report(detected.takeError());
+      auto machine = detected->createTargetMachine();
+      if (!machine)
+        return report(machine.takeError());
+      host = std::move(*machine);
+      return true;
+    }
+
+    // Starts a module of its own context, so that it can be handed over to the
+    // JIT, targeting the machine we are running on unless given another.
+    bool prepare(const std::string &name, llvm::TargetMachine *target = nullptr) {
+      if (!this->target())
+        return false;
+      machine = target ? target : host.get();
+      builder.reset();
+      module.reset();
+      declared.clear();
+      context = std::make_unique<llvm::LLVMContext>();
+      builder = std::make_unique<llvm::IRBuilder<llvm::NoFolder>>(*context);
+      if (mode == parser::Math::Fast)
+        builder->setFastMathFlags(llvm::FastMathFlags::getFast());
+      module  = std::make_unique<llvm::Module>(name, *context);
+      module->setTargetTriple(machine->getTargetTriple().str());
+      module->setDataLayout(machine->createDataLayout());
+      return true;
+    }
+
+    llvm::Function *declare(const std::string &name, llvm::FunctionType *type) {
+      auto &fn = declared[name];
+      if (!fn)
+        fn = llvm::Function::Create(type, llvm::GlobalValue::ExternalLinkage, name, *module);
+      return fn;
+    }
+
+    // Math functions are declared as pure: we never read errno, and this lets
+    // LLVM merge, hoist and vectorize calls to them. The float version of name
+    // is declared for float.
+    llvm::Function *declare_math(const std::string &name, int argc, llvm::Type *type) {
+      auto fn = this->declare(type->isFloatTy() ? name + "f" : name, llvm::FunctionType::get(
+        type, std::vector<llvm::Type*>(argc, type), false));
+      fn->setDoesNotAccessMemory();
+      fn->setDoesNotThrow();
+      fn->setWillReturn();
+      return fn;
+    }
+
+    // Bit operators leave i64 values, which stay integers for as long as bit
+    // operators read them and become doubles where anything else does, as
+    // parser::Operator::integer says; constants are converted right here.
+    llvm::Value *integer(llvm::Value *v) {
+      if (v->getType() == t_int64())
+        return v;
+      if (auto c = llvm::dyn_cast<llvm::ConstantFP>(v)) {
+        auto value = c->getValueAPF();
+        bool lost;
+        value.convert(llvm::APFloat::IEEEdouble(), llvm::APFloat::rmNearestTiesToEven, &lost);
+        return llvm::ConstantInt::getSigned(t_int64(), parser::Operator::integer(value.convertToDouble()));
+      }
+      // fptosi is poison out of range, so those values take the select
+      auto fabs = builder->CreateUnaryIntrinsic(llvm::Intrinsic::fabs, v);
+      auto in_range = builder->CreateFCmpOLT(fabs, llvm::ConstantFP::get(v->getType(), 9223372036854775808.0));
+      return builder->CreateSelect(in_range, builder->CreateFPToSI(v, t_int64()),
+        llvm::ConstantInt::get(t_int64(), INT64_MIN));
+    }
+
+    llvm::Value *real(llvm::Value *v) {
+      return v->getType() == t_int64() ? builder->CreateSIToFP(v, t_real()) : v;
+    }
+
+    // Float32 code rounds what it loads to float and widens what it stores.
+    llvm::Value *narrow(llvm::Value *v) {
+      return mode == parser::Math::Float32 ? builder->CreateFPTrunc(v, t_real()) : v;
+    }
+
+    llvm::Value *widen(llvm::Value *v) {
+      v = this->real(v);
+      return v->getType() == t_double() ? v : builder->CreateFPExt(v, t_double());
+    }
+
+    llvm::Value *bits(llvm::Instruction::BinaryOps op, arena::Vector<llvm::Value*> &v) {
+      auto a = this->integer(v[0]), b = this->integer(v[1]);
+      // shift counts are taken modulo 64
+      if (op == llvm::Instruction::AShr || op == llvm::Instruction::Shl) {
+        if (auto c = llvm::dyn_cast<llvm::ConstantInt>(b))
+          b = llvm::ConstantInt::get(t_int64(), c->getZExtValue() & 63);
+        else
+          b = builder->CreateAnd(b, llvm::ConstantInt::get(t_int64(), 63));
+      }
+      return builder->CreateBinOp(op, a, b);
+    }
+
+    llvm::Value *apply(parser::Operator::Type op, arena::Vector<llvm::Value*> &v) {
+      using namespace parser;
+      switch (op) {
+        case Operator::And: return this->bits(llvm::Instruction::And, v);
+        case Operator::Or:  return this->bits(llvm::Instruction::Or, v);
+        case Operator::Xor: return this->bits(llvm::Instruction::Xor, v);
+        case Operator::Rsh: return this->bits(llvm::Instruction::AShr, v);
+        case Operator::Lsh: return this->bits(llvm::Instruction::Shl, v);
+        case Operator::Not: return builder->CreateNot(this->integer(v[0]));
+        case Operator::Pos: return v[0];
+        default: break;
+      }
+      for (auto &x : v)
+        x = this->real(x);
+      switch (op) {
+        case Operator::Add: return builder->CreateFAdd(v[0], v[1]);
+        case Operator::Sub: return builder->CreateFSub(v[0], v[1]);
+        case Operator::Mul: return builder->CreateFMul(v[0], v[1]);
+        case Operator::Div: return builder->CreateFDiv(v[0], v[1]);
+        case Operator::Rem: return builder->CreateFRem(v[0], v[1]);
+        case Operator::Exp: return builder->CreateCall(this->declare_math("pow", 2, t_real()), v);
+        case Operator::Neg: return builder->CreateFNeg(v[0]);
+        default: return v[0];
+      }
+    }
+
+    // Reduces v pairwise with the intrinsic id, as parser::Function::tree
+    // does, so that the reduction is log2 of the arguments deep.
+    llvm::Value *tree(llvm::Intrinsic::ID id, arena::Vector<llvm::Value*> &v) {
+      for (size_t width = 1; width < v.size(); width *= 2)
+        for (size_t i = 0; i + width < v.size(); i += 2 * width)
+          v[i] = builder->CreateBinaryIntrinsic(id, v[i], v[i + width]);
+      return v[0];
+    }
+
+    // hypot of three or more values, as parser::Function::hypot computes it:
+    // the largest magnitude scales the rest, the scaled squares are summed in
+    // order and one sqrt finishes it. No libm call is left, so batch loops
+    // vectorize without libmvec.
+    llvm::Value *hypot(arena::Vector<llvm::Value*> &v) {
+      auto type = v[0]->getType();
+      arena::Vector<llvm::Value*> magnitudes;
+      for (auto x : v)
+        magnitudes.push_back(builder->CreateUnaryIntrinsic(llvm::Intrinsic::fabs, x));
+      auto m = this->tree(llvm::Intrinsic::maxnum, magnitudes);
+      auto d = builder->CreateSelect(builder->CreateFCmpOEQ(m, llvm::ConstantFP::get(type, 0.0)),
+        llvm::ConstantFP::get(type, 1.0), m);
+      llvm::Value *s = nullptr;
+      for (auto x : v) {
+        auto q = builder->CreateFDiv(x, d);
+        q = builder->CreateFMul(q, q);
+        s = s ? builder->CreateFAdd(s, q) : q;
+      }
+      auto r = builder->CreateFMul(d, builder->CreateUnaryIntrinsic(llvm::Intrinsic::sqrt, s));
+      return builder->CreateSelect(builder->CreateFCmpOEQ(m, llvm::ConstantFP::getInfinity(type)), m, r);
+    }
+
+    llvm::Value *apply(parser::Function::Type fn, arena::Vector<llvm::Value*> &v) {
+      if (v.empty())
+        return llvm::Constant::getNullValue(t_real());
+      // hypot of floats is computed in double and rounded once, since
+      // intermediate results may not fit in a float
+      bool wide = fn == parser::Function::Hypot && mode == parser::Math::Float32;
+      for (auto &x : v)
+        x = wide ? this->widen(x) : this->real(x);
+      auto &math = ir_math.at(fn);
+      auto intrinsic = mode == parser::Math::Fast ? ir_intrinsics.find(fn) : ir_intrinsics.end();
+      auto type = v[0]->getType();
+      auto call = [&](llvm::ArrayRef<llvm::Value*> args) -> llvm::Value* {
+        if (intrinsic != ir_intrinsics.end())
+          return builder->CreateIntrinsic(intrinsic->second, { type }, args);
+        return builder->CreateCall(this->declare_math(math.first, math.second, type), args);
+      };
+      llvm::Value *out;
+      if (fn == parser::Function::Max || fn == parser::Function::Min)
+        out = this->tree(fn == parser::Function::Max ? llvm::Intrinsic::maxnum : llvm::Intrinsic::minnum, v);
+      else if (fn == parser::Function::Hypot && v.size() > 2)
+        out = this->hypot(v);
+      else if (parser::Function::arity(fn) == -1)
+        out = parser::Function::binary_reduce<llvm::Value*>(v, [&](auto a, auto b) { return call({ a, b }); });
+      else
+        out = call(llvm::makeArrayRef(v.data(), v.size()).take_front(math.second));
+      return wide ? builder->CreateFPTrunc(out, t_real()) : out;
+    }
+
+    // Builds program at the current insertion point, reading input slot k
+    // through loader(k); the outputs of a fused program go to output(k, value).
+    // Inputs and results are doubles, whatever the mode computes in.
+    bool lower(const parser::Program &program, std::function<llvm::Value*(unsigned int)> loader, llvm::Value *&out,
+        std::function<void(unsigned int, llvm::Value*)> output = nullptr) {
+      if (!parser::eval<llvm::Value*>(
+            program,
+            out,
+            [&](auto a) { return llvm::ConstantFP::get(t_real(), a); },
+            [&](auto slot) { return this->narrow(loader(slot)); },
+            [&](auto op, auto &v) { return this->apply(op, v); },
+            [&](auto fn, auto &v) { return this->apply(fn, v); },
+            output ? [&](auto k, auto value) { output(k, this->widen(value)); }
+                   : std::function<void(unsigned int, llvm::Value*)>()))
+        return false;
+      if (out)
+        out = this->widen(out);
+      return true;
+    }
+
+    // Emits program as `double name(double *vars)` into the current module,
+    // or a fused program as `void name(double *vars, double *out)`.
+    bool emit(const parser::Program &program, const std::string &name, llvm::Function *&out) {
+      bool fused = program.outputs();
+      auto fn = llvm::Function::Create(
+        fused ? llvm::FunctionType::get(llvm::Type::getVoidTy(*context), { t_double_ptr(), t_double_ptr() }, false)
+              : llvm::FunctionType::get(t_double(), { t_double_ptr() }, false),
+        llvm::GlobalValue::ExternalLinkage,
+        name,
+        *module
+      );
+      auto vars = fn->getArg(0);
+      vars->setName("vars");
+      builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", fn));
+      llvm::Value* result = nullptr;
+      auto results = fused ? fn->getArg(1) : nullptr;
+      if (fused)
+        results->setName("out");
+      if (!this->lower(program, [&](auto slot) -> llvm::Value* {
+            return builder->CreateLoad(t_double(), builder->CreateConstInBoundsGEP1_32(t_double(), vars, slot));
+          }, result, [&](auto k, auto value) {
+            builder->CreateStore(value, builder->CreateConstInBoundsGEP1_32(t_double(), results, k));
+          }))
+        return false;
+      if (fused)
+        builder->CreateRetVoid();
+      else
+        builder->CreateRet(result);
+      out = fn;
+      return true;
+    }
+
+    // Lets the loop vectorizer replace call with a libmvec variant of its
+    // callee for any of isas, declaring the variants it may use.
+    void vectorize_call(llvm::CallInst *call, const std::vector<std::pair<char, unsigned int>> &isas) {
+      auto callee = call->getCalledFunction();
+      if (!callee)
+        return;
+      auto scalar = callee->getName().str();
+      // twice as many floats as doubles fit in a vector
+      bool single = call->getType()->isFloatTy();
+      auto it = vector_math.find(single ? scalar.substr(0, scalar.size() - 1) : scalar);
+      if (it == vector_math.end())
+        return;
+      llvm::SmallVector<std::string, 8> variants;
+      for (auto &isa : isas) {
+        auto lanes = isa.second * (single ? 2 : 1);
+        auto name = std::string("_ZGV") + isa.first + "N" + std::to_string(lanes) +
+          std::string(it->second, 'v') + "_" + scalar;
+        if (!declared.count(name)) {
+          auto type = llvm::FixedVectorType::get(call->getType(), lanes);
+          auto fn = this->declare(name, llvm::FunctionType::get(
+            type, std::vector<llvm::Type*>(it->second, type), false));
+          fn->setDoesNotAccessMemory();
+          fn->setDoesNotThrow();
+          // kept alive until the vectorizer gets to see it
+          llvm::appendToCompilerUsed(*module, { fn });
+        }
+        variants.push_back(llvm::VFABI::mangleTLIVectorName(
+          name, scalar, it->second, llvm::ElementCount::getFixed(lanes)));
+      }
+      llvm::VFABI::setVectorVariantNames(call, variants);
+    }
+
+    // Emits program as `void name(const double **columns, i64 rows, double *out)`:
+    // a loop that evaluates it for every row, reading columns[slot][row] and
+    // writing out[row], or out[k][row] for output k of a fused program, whose
+    // out is a double **. With vector_math the loop vectorizer may call
+    // libmvec as wide as the host allows.
+    bool emit_batch(const parser::Program &program, const std::string &name, bool vector_math, llvm::Function *&out) {
+      auto t_columns = llvm::PointerType::getUnqual(t_double_ptr());
+      bool fused = program.outputs();
+      auto fn = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*context),
+          { t_columns, t_int64(), fused ? t_columns : t_double_ptr() }, false),
+        llvm::GlobalValue::ExternalLinkage,
+        name,
+        *module
+      );
+      auto columns = fn->getArg(0), rows = fn->getArg(1), results = fn->getArg(2);
+      columns->setName("columns");
+      rows->setName("rows");
+      results->setName("out");
+      auto entry = llvm::BasicBlock::Create(*context, "entry", fn);
+      auto loop = llvm::BasicBlock::Create(*context, "loop", fn);
+      auto exit = llvm::BasicBlock::Create(*context, "exit", fn);
+
+      builder->SetInsertPoint(entry);
+      std::vector<llvm::Value*> column(program.slots());
+      for (unsigned int slot = 0; slot < program.slots(); slot++)
+        column[slot] = builder->CreateLoad(t_double_ptr(), builder->CreateConstInBoundsGEP1_32(t_double_ptr(), columns, slot));
+      std::vector<llvm::Value*> outputs(program.outputs());
+      for (unsigned int k = 0; k < program.outputs(); k++)
+        outputs[k] = builder->CreateLoad(t_double_ptr(), builder->CreateConstInBoundsGEP1_32(t_double_ptr(), results, k));
+      auto zero = llvm::ConstantInt::get(t_int64(), 0);
+      builder->CreateCondBr(builder->CreateICmpEQ(rows, zero), exit, loop);
+
+      builder->SetInsertPoint(loop);
+      auto row = builder->CreatePHI(t_int64(), 2, "row");
+      row->addIncoming(zero, entry);
+      llvm::Value *result = nullptr;
+      if (!this->lower(program, [&](auto slot) -> llvm::Value* {
+            return builder->CreateLoad(t_double(), builder->CreateInBoundsGEP(t_double(), column[slot], row));
+          }, result, [&](auto k, auto value) {
+            builder->CreateStore(value, builder->CreateInBoundsGEP(t_double(), outputs[k], row));
+          }))
+        return false;
+      if (!fused)
+        builder->CreateStore(result, builder->CreateInBoundsGEP(t_double(), results, row));
+      auto next = builder->CreateAdd(row, llvm::ConstantInt::get(t_int64(), 1));
+      row->addIncoming(next, loop);
+      auto back = builder->CreateCondBr(builder->CreateICmpEQ(next, rows), exit, loop);
+      if (fused) {
+        // With many outputs there are too many pairs of columns for the
+        // vectorizer to check for overlap at run time, so rows are declared
+        // independent: fused kernels must not write over their inputs.
+        auto group = llvm::MDNode::getDistinct(*context, {});
+        for (auto &instr : *loop)
+          if (llvm::isa<llvm::LoadInst>(instr) || llvm::isa<llvm::StoreInst>(instr))
+            instr.setMetadata(llvm::LLVMContext::MD_access_group, group);
+        auto parallel = llvm::MDNode::get(*context, { llvm::MDString::get(*context, "llvm.loop.parallel_accesses"), group });
+        auto id = llvm::MDNode::getDistinct(*context, { nullptr, parallel });
+        id->replaceOperandWith(0, id);
+        back->setMetadata(llvm::LLVMContext::MD_loop, id);
+      }
+
+      builder->SetInsertPoint(exit);
+      builder->CreateRetVoid();
+
+      if (this->avx512())
+        fn->addFnAttr("prefer-vector-width", "512");
+      if (vector_math) {
+        auto isas = vector_isas();
+        for (auto &instr : *loop)
+          if (auto call = llvm::dyn_cast<llvm::CallInst>(&instr))
+            this->vectorize_call(call, isas);
+      }
+      out = fn;
+      return true;
+    }
+
+    void print(const char *format, std::initializer_list<llvm::Value*> values) {
+      auto ll_format = builder->CreateGlobalStringPtr(format);
+      std::vector<llvm::Value*> args {ll_format};
+      args.insert(args.end(), values);
+      builder->CreateCall(
+        this->declare("printf", llvm::FunctionType::get(t_int32(), { t_char_ptr() }, true)), args);
+    }
+
+    // Runs the default pipeline of the new pass manager for -O<level> over the
+    // current module; -O0 leaves the IR as it was built.
+    void optimize(unsigned int level) {
+      stats::Timer timer(stats::Optimize);
+      static const llvm::OptimizationLevel levels[] = {
+        llvm::OptimizationLevel::O0,
+        llvm::OptimizationLevel::O1,
+        llvm::OptimizationLevel::O2,
+        llvm::OptimizationLevel::O3
+      };
+      if (!level)
+        return;
+      llvm::LoopAnalysisManager lam;
+      llvm::FunctionAnalysisManager fam;
+      llvm::CGSCCAnalysisManager cgam;
+      llvm::ModuleAnalysisManager mam;
+      llvm::PassBuilder passes(machine);
+      passes.registerModuleAnalyses(mam);
+      passes.registerCGSCCAnalyses(cgam);
+      passes.registerFunctionAnalyses(fam);
+      passes.registerLoopAnalyses(lam);
+      passes.crossRegisterProxies(lam, fam, cgam, mam);
+      passes.buildPerModuleDefaultPipeline(levels[std::min(level, 3u)]).run(*module, mam);
+    }
+
+    // The object file programs are kept in once compiled into kind at -O<level>:
+    // named after a hash of the programs and of everything their code depends on.
+    std::string object_path(const std::vector<const parser::Program*> &programs, const std::string &kind,
+        unsigned int level) {
+      std::string key = kind + '\0' + std::to_string(level) + '\0' + std::to_string(mode) + '\0' +
+        std::to_string(object_format) + '\0' +
+        LLVM_VERSION_STRING + '\0' +
+        host->getTargetTriple().str() + '\0' + host->getTargetCPU().str() + '\0' +
+        host->getTargetFeatureString().str() + '\0' + (shared.libmvec ? "libmvec" : "");
+      for (auto program : programs)
+        serialize(*program, key);
+      return directory + "/" + kind + "-" + llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(key)), true) + ".o";
+    }
+
+    // Compiles programs with emit, which builds them into the current module
+    // under the name it is given, hands the module to the JIT and looks up the
+    // name followed by each of suffixes. With a directory to keep object code
+    // in, object code found there is linked instead, and each module gets a
+    // JITDylib of its own, since the modules kept on disk all use the same
+    // names. With a tracker, the code can be unloaded again.
+    bool load(const std::vector<const parser::Program*> &programs, const std::string &kind, unsigned int level,
+        std::function<bool(const std::string&)> emit, const std::vector<std::string> &suffixes,
+        std::vector<llvm::JITTargetAddress> &out, Tracker *tracker) {
+      if (!this->target())
+        return false;
+      auto name = kind + std::to_string(shared.kernels++), id = name;
+      auto *dylib = &shared.session->getMainJITDylib();
+      if (!directory.empty()) {
+        auto own = shared.session->createJITDylib(name);
+        if (!own)
+          return report(own.takeError());
+        own->addToLinkOrder(*dylib);
+        dylib = &*own;
+        name = kind;
+        id = this->object_path(programs, kind, level);
+      }
+      auto owner = tracker ? (*tracker = dylib->createResourceTracker()) : dylib->getDefaultResourceTracker();
+      // large objects are mapped rather than read
+      auto object = directory.empty() ? std::make_error_code(std::errc::no_such_file_or_directory) :
+        llvm::MemoryBuffer::getFile(id, false, false);
+      if (object) {
+        if (auto error = shared.session->addObjectFile(owner, std::move(*object)))
+          return report(std::move(error));
+      } else {
+        // a module named after its object file is written there once compiled
+        {
+          stats::Timer timer(stats::Build);
+          if (!this->prepare(id) || !emit(name) || llvm::verifyModule(*module, &llvm::errs()))
+            return false;
+        }
+        this->optimize(level);
+        builder.reset();
+        declared.clear();
+        if (auto error = shared.session->addIRModule(owner, llvm::orc::ThreadSafeModule(std::move(module), std::move(context))))
+          return report(std::move(error));
+      }
+      // code is generated and linked on the first lookup
+      stats::Timer timer(stats::Jit);
+      out.clear();
+      for (auto &suffix : suffixes) {
+        auto symbol = shared.session->lookup(*dylib, name + suffix);
+        if (!symbol)
+          return report(symbol.takeError());
+        out.push_back(symbol->getAddress());
+      }
+      return true;
+    }
+
+    // As above, for one program named name itself.
+    bool load(const parser::Program &program, const std::string &kind, unsigned int level,
+        std::function<bool(const std::string&)> emit, llvm::JITTargetAddress &out, Tracker *tracker) {
+      std::vector<llvm::JITTargetAddress> addresses;
+      if (!this->load({ &program }, kind, level, emit, { "" }, addresses, tracker))
+        return false;
+      out = addresses[0];
+      return true;
+    }
+
+    // A machine for target that emits position-independent code, so that
+    // what it compiles links into executables and shared libraries alike.
+    bool cross(const Target &target, unsigned int level, std::unique_ptr<llvm::TargetMachine> &out) {
+      if (!this->target())
+        return false;
+      shared.all_targets();
+      llvm::orc::JITTargetMachineBuilder builder(llvm::Triple(llvm::Triple::normalize(target.triple)));
+      if (target.triple.empty()) {
+        auto detected = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!detected)
+          return report(detected.takeError());
+        builder = std::move(*detected);
+      }
+      // the features detected on the host are those of its CPU, so they go as
+      // soon as another CPU or features are asked for
+      if (target.triple.empty() && (!target.cpu.empty() || !target.features.empty()))
+        builder.getFeatures() = llvm::SubtargetFeatures();
+      if (!target.cpu.empty())
+        builder.setCPU(target.cpu);
+      if (!target.features.empty())
+        builder.addFeatures({ target.features });
+      builder.setRelocationModel(llvm::Reloc::PIC_);
+      builder.setCodeModel(llvm::CodeModel::Small);
+      builder.setCodeGenOptLevel(level ? llvm::CodeGenOpt::Default : llvm::CodeGenOpt::None);
+      auto machine = builder.createTargetMachine();
+      if (!machine)
+        return report(machine.takeError());
+      if (!target.cpu.empty() && !(*machine)->getMCSubtargetInfo()->isCPUStringValid(target.cpu)) {
+        printf("Unknown CPU '%s' for %s\n", target.cpu.c_str(), (*machine)->getTargetTriple().str().c_str());
+        return false;
+      }
+      if ((*machine)->createDataLayout().getPointerSize() != 8) {
+        printf("Target %s is not 64-bit\n", (*machine)->getTargetTriple().str().c_str());
+        return false;
+      }
+      out = std::move(*machine);
+      return true;
+    }
+
+    // Compiles the current module to object code.
+    bool object(llvm::SmallVectorImpl<char> &out) {
+      llvm::raw_svector_ostream stream(out);
+      llvm::legacy::PassManager passes;
+      if (machine->addPassesToEmitFile(passes, stream, nullptr, llvm::CGFT_ObjectFile)) {
+        printf("Target %s cannot emit object files\n", machine->getTargetTriple().str().c_str());
+        return false;
+      }
+      passes.run(*module);
+      return true;
+    }
+
+    // Kernels are exported under names of the caller's choosing, which must
+    // not clash with each other or with the libm functions they call.
+    static bool exportable(const std::vector<std::string> &names) {
+      // and they have to be usable from C
+      std::set<std::string> taken {
+        "printf", "main", "auto", "break", "case", "char", "const", "continue", "default", "do", "double",
+        "else", "enum", "extern", "float", "for", "goto", "if", "inline", "int", "long", "register",
+        "restrict", "return", "short", "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+        "unsigned", "void", "volatile", "while"
+      };
+      for (auto &kv : ir_math) {
+        taken.insert(kv.second.first);
+        taken.insert(kv.second.first + "f");
+      }
+      for (auto &name : names) {
+        bool identifier = !name.empty() && !isdigit((unsigned char)name[0]);
+        for (char c : name)
+          identifier = identifier && (isalnum((unsigned char)c) || c == '_');
+        if (!identifier || taken.count(name) || taken.count(name + "_batch")) {
+          printf("Cannot export a kernel as '%s'\n", name.c_str());
+          return false;
+        }
+        taken.insert(name);
+        taken.insert(name + "_batch");
+      }
+      return true;
+    }
+
+   public:
+    // Builds and verifies the IR of program without compiling it any further.
+    bool build(const parser::Program &program) {
+      stats::Timer timer(stats::Build);
+      llvm::Function *fn;
+      return this->prepare("expr") && this->emit(program, "expr", fn) && !llvm::verifyModule(*module, &llvm::errs());
+    }
+
+    // Writes path: the expression as `double expr(double *vars)` and a main
+    // that prints its value. vars holds the value of each input slot; they are
+    // baked into the module as a constant array so main stays runnable on its own.
+    bool compile(const parser::Program &program, const double *vars = nullptr, unsigned int level = 0,
+        const std::string &path = "main.ll") {
+      if (!this->prepare(path))
+        return false;
+      llvm::Function *expr;
+      if (!this->emit(program, "expr", expr))
+        return false;
+      auto main = this->declare("main", llvm::FunctionType::get(t_int32(), {}, false));
+      builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", main));
+      llvm::Value *args = llvm::Constant::getNullValue(t_double_ptr());
+      if (program.slots()) {
+        auto inputs = new llvm::GlobalVariable(
+          *module,
+          llvm::ArrayType::get(t_double(), program.slots()),
+          true,
+          llvm::GlobalValue::PrivateLinkage,
+          llvm::ConstantDataArray::get(*context, llvm::makeArrayRef(vars, program.slots())),
+          "vars"
+        );
+        args = builder->CreateConstInBoundsGEP2_32(inputs->getValueType(), inputs, 0, 0);
+      }
+      this->print("Result: %.3lf\n", { builder->CreateCall(expr, { args }) });
+      builder->CreateRet(llvm::Constant::getNullValue(t_int32()));
+      if (llvm::verifyModule(*module, &llvm::errs()))
+        return false;
+      this->optimize(level);
+      std::error_code error;
+      llvm::raw_fd_ostream stream(path, error);
+      if (error) {
+        printf("Cannot write %s: %s\n", path.c_str(), error.message().c_str());
+        return false;
+      }
+      module->print(stream, nullptr);
+      return true;
+    }
+
+    // Compiles programs ahead of time into path: an object file, or a static
+    // library with one member per program if path ends in .a, so that a
+    // linker takes only the kernels that are used. Program k is exported as
+    // `double names[k](const double *vars)` and `void names[k]_batch(const
+    // double *const *columns, size_t rows, double *out)`, or with the
+    // signatures of FusedKernel and FusedBatchKernel if it is fused. The code
+    // needs nothing but libm at run time. Batch loops are vectorized for the
+    // target but call scalar libm, since libmvec may not be there.
+    bool aot(const std::vector<parser::Program> &programs, const std::vector<std::string> &names,
+        const std::string &path, unsigned int level = 2, const Target &target = Target()) {
+      std::unique_ptr<llvm::TargetMachine> machine;
+      if (programs.empty() || names.size() != programs.size()) {
+        printf("Need one name for each of one or more programs\n");
+        return false;
+      }
+      if (!exportable(names) || !this->cross(target, level, machine))
+        return false;
+      bool archive = llvm::StringRef(path).endswith(".a");
+      // one module for an object file, one per program for a library
+      std::vector<llvm::SmallVector<char, 0>> objects;
+      for (size_t begin = 0, end; begin < programs.size(); begin = end) {
+        end = archive ? begin + 1 : programs.size();
+        {
+          stats::Timer timer(stats::Build);
+          if (!this->prepare(archive ? names[begin] : path, machine.get()))
+            return false;
+          for (size_t k = begin; k < end; k++) {
+            llvm::Function *fn;
+            if (!this->emit(programs[k], names[k], fn) || !this->emit_batch(programs[k], names[k] + "_batch", false, fn))
+              return false;
+          }
+          if (llvm::verifyModule(*module, &llvm::errs()))
+            return false;
+        }
+        this->optimize(level);
+        objects.emplace_back();
+        if (!this->object(objects.back()))
+          return false;
+      }
+      if (!archive) {
+        if (auto error = llvm::writeFileAtomically(path + ".%%%%%%", path, llvm::StringRef(objects[0].data(), objects[0].size())))
+          return report(std::move(error));
+        return true;
+      }
+      std::vector<std::string> files;
+      std::vector<llvm::NewArchiveMember> members;
+      for (size_t k = 0; k < objects.size(); k++)
+        files.push_back(names[k] + ".o");
+      for (size_t k = 0; k < objects.size(); k++)
+        members.emplace_back(llvm::MemoryBufferRef(llvm::StringRef(objects[k].data(), objects[k].size()), files[k]));
+      auto kind = machine->getTargetTriple().isOSDarwin() ? llvm::object::Archive::K_DARWIN : llvm::object::Archive::K_GNU;
+      if (auto error = llvm::writeArchive(path, members, true, kind, true, false))
+        return report(std::move(error));
+      return true;
+    }
+
+    // Keeps the object code of every kernel this compiler JIT-compiles from
+    // now on in directory, and links code found there instead of compiling it
+    // again, so that a restarted process skips LLVM for what it has seen
+    // before. Files are keyed by the program, the -O level, the math mode and
+    // the host CPU.
+    bool persist(const std::string &directory) {
+      if (auto error = llvm::sys::fs::create_directories(directory)) {
+        printf("Cannot create %s: %s\n", directory.c_str(), error.message().c_str());
+        return false;
+      }
+      this->directory = directory;
+      return true;
+    }
+
+    // Compiles everything from now on for mode, as parser::Math describes;
+    // kernels compiled before keep the mode they were compiled for.
+    void math(parser::Math::Mode mode) {
+      this->mode = mode;
+    }
+
+    // Compiles program in process and returns its entry point. The code stays
+    // loaded for the lifetime of the process, or until tracker is removed.
+    bool jit(const parser::Program &program, Kernel &out, unsigned int level = 0, Tracker *tracker = nullptr) {
+      llvm::JITTargetAddress address;
+      if (!check(program, false) || !this->load(program, "expr", level, [&](auto &name) {
+            llvm::Function *fn;
+            return this->emit(program, name, fn);
+          }, address, tracker))
+        return false;
+      out = (Kernel)address;
+      return true;
+    }
+
+    // Compiles a fused program, as simplify::fuse makes, in process.
+    bool jit(const parser::Program &program, FusedKernel &out, unsigned int level = 0, Tracker *tracker = nullptr) {
+      llvm::JITTargetAddress address;
+      if (!check(program, true) || !this->load(program, "fused", level, [&](auto &name) {
+            llvm::Function *fn;
+            return this->emit(program, name, fn);
+          }, address, tracker))
+        return false;
+      out = (FusedKernel)address;
+      return true;
+    }
+
+    // Compiles all of programs into one module, so that the declarations,
+    // verification, optimization, code generation and linking happen once
+    // rather than per program, and returns one kernel per program. With dedup,
+    // programs with the same code share one function; simplify programs
+    // first to have more of them turn out the same.
+    bool jit_all(const std::vector<parser::Program> &programs, std::vector<Kernel> &out, unsigned int level = 0,
+        bool dedup = true, Tracker *tracker = nullptr) {
+      // the function of each program, and the first program of each function
+      std::vector<size_t> function(programs.size());
+      std::vector<const parser::Program*> unique;
+      std::unordered_map<std::string, size_t> seen;
+      for (size_t i = 0; i < programs.size(); i++) {
+        if (!check(programs[i], false))
+          return false;
+        function[i] = unique.size();
+        if (dedup) {
+          std::string key;
+          serialize(programs[i], key);
+          function[i] = seen.emplace(std::move(key), unique.size()).first->second;
+        }
+        if (function[i] == unique.size())
+          unique.push_back(&programs[i]);
+      }
+      std::vector<std::string> suffixes;
+      for (size_t f = 0; f < unique.size(); f++)
+        suffixes.push_back("_" + std::to_string(f));
+      std::vector<llvm::JITTargetAddress> addresses;
+      if (!this->load(unique, "exprs", level, [&](auto &name) {
+            llvm::Function *fn;
+            for (size_t f = 0; f < unique.size(); f++)
+              if (!this->emit(*unique[f], name + suffixes[f], fn))
+                return false;
+            return true;
+          }, suffixes, addresses, tracker))
+        return false;
+      out.resize(programs.size());
+      for (size_t i = 0; i < programs.size(); i++)
+        out[i] = (Kernel)addresses[function[i]];
+      return true;
+    }
+
+    // Compiles program into a loop over input columns. From -O2 the loop is
+    // vectorized for the host CPU, with math calls going to libmvec when it is
+    // installed; results may then differ from libm in the last bit.
+    bool jit_batch(const parser::Program &program, BatchKernel &out, unsigned int level = 2, Tracker *tracker = nullptr) {
+      llvm::JITTargetAddress address;
+      if (!check(program, false) || !this->load(program, "batch", level, [&](auto &name) {
+            llvm::Function *fn;
+            return this->emit_batch(program, name, shared.libmvec, fn);
+          }, address, tracker))
+        return false;
+      out = (BatchKernel)address;
+      return true;
+    }
+
+    // The loop of a fused program: inputs are loaded once per row, and
+    // subexpressions the outputs share computed once, for all outputs.
+    bool jit_batch(const parser::Program &program, FusedBatchKernel &out, unsigned int level = 2,
+        Tracker *tracker = nullptr) {
+      llvm::JITTargetAddress address;
+      if (!check(program, true) || !this->load(program, "batch", level, [&](auto &name) {
+            llvm::Function *fn;
+            return this->emit_batch(program, name, shared.libmvec, fn);
+          }, address, tracker))
+        return false;
+      out = (FusedBatchKernel)address;
+      return true;
+    }
+  };
+}
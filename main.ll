@@ -1,9 +1,11 @@
 ; ModuleID = 'main.ll'
 source_filename = "main.ll"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
 
 @0 = private unnamed_addr constant [15 x i8] c"Result: %.3lf\0A\00", align 1
 
-define i32 @main() {
+define double @expr(double* %vars) {
 entry:
   %0 = fneg double 1.000000e+00
   %1 = fadd double 6.000000e+00, 2.000000e+00
@@ -16,30 +18,40 @@ entry:
   %8 = fadd double %7, 0x400921FB54442D18
   %9 = fmul double 0x4005BF0A8B145769, 1.010000e-01
   %10 = fsub double %8, %9
-  %11 = fptosi double 1.000000e+00 to i32
-  %12 = fptosi double 5.000000e+00 to i32
-  %13 = shl i32 %11, %12
-  %14 = sitofp i32 %13 to double
-  %15 = fsub double %10, %14
-  %16 = fneg double 2.000000e+00
-  %17 = call double @hypot(double 1.000000e+00, double %16)
-  %18 = call double @hypot(double %17, double 3.000000e+00)
-  %19 = fneg double %18
-  %20 = call double @fmin(double 4.000000e+00, double 5.000000e+00)
-  %21 = call double @fmax(double 1.000000e+00, double 2.000000e+00)
-  %22 = call double @fmax(double %21, double %20)
-  %23 = fmul double %19, %22
-  %24 = fadd double %15, %23
-  %25 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([15 x i8], [15 x i8]* @0, i32 0, i32 0), double %24)
-  ret i32 0
+  %11 = shl i64 1, 5
+  %12 = sitofp i64 %11 to double
+  %13 = fsub double %10, %12
+  %14 = fneg double 2.000000e+00
+  %15 = call double @hypot(double 1.000000e+00, double %14)
+  %16 = call double @hypot(double %15, double 3.000000e+00)
+  %17 = fneg double %16
+  %18 = call double @fmin(double 4.000000e+00, double 5.000000e+00)
+  %19 = call double @fmax(double 1.000000e+00, double 2.000000e+00)
+  %20 = call double @fmax(double %19, double %18)
+  %21 = fmul double %17, %20
+  %22 = fadd double %13, %21
+  ret double %22
 }
 
-declare double @pow(double, double)
+; Function Attrs: nounwind readnone willreturn
+declare double @pow(double, double) #0
 
-declare double @hypot(double, double)
+; Function Attrs: nounwind readnone willreturn
+declare double @hypot(double, double) #0
 
-declare double @fmin(double, double)
+; Function Attrs: nounwind readnone willreturn
+declare double @fmin(double, double) #0
 
-declare double @fmax(double, double)
+; Function Attrs: nounwind readnone willreturn
+declare double @fmax(double, double) #0
+
+define i32 @main() {
+entry:
+  %0 = call double @expr(double* null)
+  %1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([15 x i8], [15 x i8]* @0, i32 0, i32 0), double %0)
+  ret i32 0
+}
 
 declare i32 @printf(i8*, ...)
+
+attributes #0 = { nounwind readnone willreturn }
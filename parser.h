@@ -0,0 +1,992 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stack>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <strings.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#define l_1(fn) ([](auto a) { return fn(a); })
+#define l_2(fn) ([](auto a, auto b) { return fn(a, b); })
+#define v_1(fn) ([](auto &v) { return fn(v[0]); })
+#define v_2(fn) ([](auto &v) { return fn(v[0], v[1]); })
+#define f_1(fn) ([](auto &v) { return (double)fn((float)v[0]); })
+#define f_2(fn) ([](auto &v) { return (double)fn((float)v[0], (float)v[1]); })
+
+static bool debug = false;
+
+namespace parser {
+  // Where parse errors and -d dumps are reported; stream::run points it at
+  // stderr, so that stdout carries nothing but results.
+  inline FILE *diagnostics = stdout;
+
+  namespace Operator {
+    #define op_id(precedence, arity) (((__COUNTER__) << 8) + ((precedence & 0xf) << 4) + ((arity) & 0xf))
+    enum Type {
+      Noop = op_id(0, 0),
+      Sep  = op_id(1, 2),
+      And  = op_id(2, 2),
+      Or   = op_id(2, 2),
+      Xor  = op_id(2, 2),
+      Rsh  = op_id(3, 2),
+      Lsh  = op_id(3, 2),
+      Add  = op_id(4, 2),
+      Sub  = op_id(4, 2),
+      Mul  = op_id(5, 2),
+      Div  = op_id(5, 2),
+      Rem  = op_id(5, 2),
+      Exp  = op_id(6, 2),
+      Not  = op_id(7, 1),
+      Pos  = op_id(7, 1),
+      Neg  = op_id(7, 1),
+      Lbr  = op_id(8, 0),
+      Rbr  = op_id(8, 0),
+      Fn   = op_id(8, 0)
+    };
+
+    static constexpr unsigned int id(Type op) {
+      return op >> 8;
+    }
+
+    static constexpr unsigned int precedence(Type op) {
+      return (op >> 4) & 0xf;
+    }
+
+    static constexpr unsigned int arity(Type op) {
+      return op & 0xf;
+    }
+
+    static constexpr bool sentinel(Type op) {
+      return op == Type::Lbr || op == Type::Fn;
+    }
+
+    static constexpr bool bitwise(Type op) {
+      return op == And || op == Or || op == Xor || op == Rsh || op == Lsh || op == Not;
+    }
+
+    // Bit operators work on their operands truncated to 64-bit integers and
+    // take shift counts modulo 64, so that every backend gives the same
+    // result for any input. NaN and values out of range become INT64_MIN,
+    // which is what x86 converts them to anyway, so the check costs a compare.
+    static int64_t integer(double x) {
+      return std::abs(x) < 9223372036854775808.0 ? (int64_t)x : INT64_MIN;
+    }
+
+    static int64_t shift_left(int64_t a, int64_t b) {
+      return (int64_t)((uint64_t)a << (b & 63));
+    }
+
+    static int64_t shift_right(int64_t a, int64_t b) {
+      return a >> (b & 63);
+    }
+  }
+
+  namespace Function {
+    #define fn_id(arity) (((__COUNTER__) << 4) + ((arity) & 0xf))
+    enum Type {
+      Pass  = fn_id(1),
+      Abs   = fn_id(1),
+      Acos  = fn_id(1),
+      Acosh = fn_id(1),
+      Asin  = fn_id(1),
+      Asinh = fn_id(1),
+      Atan  = fn_id(1),
+      Atanh = fn_id(1),
+      Atan2 = fn_id(2),
+      Cbrt  = fn_id(1),
+      Ceil  = fn_id(1),
+      Cos   = fn_id(1),
+      Cosh  = fn_id(1),
+      Exp   = fn_id(1),
+      Floor = fn_id(1),
+      Round = fn_id(1),
+      Hypot = fn_id(-1),
+      Log   = fn_id(1),
+      Log2  = fn_id(1),
+      Log10 = fn_id(1),
+      Max   = fn_id(-1),
+      Min   = fn_id(-1),
+      Pow   = fn_id(2),
+      Sin   = fn_id(1),
+      Sinh  = fn_id(1),
+      Sqrt  = fn_id(1),
+      Tan   = fn_id(1),
+      Tanh  = fn_id(1),
+      Trunc = fn_id(1)
+    };
+
+    static constexpr unsigned int id(Type op) {
+      return op >> 4;
+    }
+
+    static constexpr int arity(Type op) {
+      return (op & 0xf) == 0xf ? -1 : (op & 0xf);
+    }
+
+    // Arguments are scratch, so they come from the arena when there is one.
+    template<typename T>
+    using nary = std::function<T(arena::Vector<T>&)>;
+
+    template<typename T>
+    T binary_reduce(arena::Vector<T> &v, std::function<T(T, T)> fn) {
+      if (v.size() == 0) return T();
+      if (v.size() == 1) return v[0];
+      T r = fn(v[0], v[1]);
+      for (size_t i = 2; i < v.size(); i++)
+        r = fn(r, v[i]);
+      return r;
+    }
+
+    // max and min as fmax and fmin define them, NaN only if both are, but
+    // simple enough for compilers to inline and vectorize.
+    static constexpr double max(double a, double b) {
+      return a > b || b != b ? a : b;
+    }
+
+    static constexpr double min(double a, double b) {
+      return a < b || b != b ? a : b;
+    }
+
+    // Reduces the n values at x pairwise, as a tree, so that no step waits on
+    // more than log2(n) others; x is overwritten. No values give 0.
+    template<typename F>
+    static double tree(double *x, size_t n, F fn) {
+      for (size_t width = 1; width < n; width *= 2)
+        for (size_t i = 0; i + width < n; i += 2 * width)
+          x[i] = fn(x[i], x[i + width]);
+      return n ? x[0] : 0;
+    }
+
+    // hypot of three or more values in one pass: the largest magnitude
+    // scales the others into [0, 1], so that the sum of their squares can
+    // neither overflow nor underflow, and one sqrt finishes it. Two values
+    // take one libm call anyway, and one is returned as it is, as
+    // binary_reduce does. Every backend computes it in this order.
+    static double hypot(const double *x, size_t n) {
+      if (n <= 2)
+        return n == 2 ? std::hypot(x[0], x[1]) : n ? x[0] : 0;
+      double m = std::abs(x[0]);
+      for (size_t i = 1; i < n; i++)
+        m = max(m, std::abs(x[i]));
+      if (std::isinf(m))
+        return m;
+      double d = m == 0 ? 1 : m, q = x[0] / d, s = q * q;
+      for (size_t i = 1; i < n; i++) {
+        q = x[i] / d;
+        s += q * q;
+      }
+      return d * std::sqrt(s);
+    }
+
+    #define r(type, fn) ([](auto &v) { return parser::Function::binary_reduce<type>(v, l_2(fn)); })
+  }
+
+  // How floating point is computed. Strict is double precision exactly as
+  // written. Fast lets generated code reassociate, contract into FMA and
+  // assume there are no NaNs, infinities or signed zeros, so its results
+  // depend on the optimization level. Float32 rounds inputs to float and
+  // computes in single precision, widening the results back to double.
+  namespace Math {
+    enum Mode { Strict, Fast, Float32 };
+
+    inline bool parse(const std::string &name, Mode &out) {
+      if (name == "strict")
+        out = Strict;
+      else if (name == "fast")
+        out = Fast;
+      else if (name == "float32")
+        out = Float32;
+      else {
+        printf("Unknown math mode '%s'\n", name.c_str());
+        return false;
+      }
+      return true;
+    }
+  }
+
+  namespace {
+    template<typename K, typename V>
+    std::map<V, K> invert_map(const std::map<K, V> &map) {
+      std::map<V, K> rmap;
+      for (auto const& kv : map)
+        rmap[kv.second] = kv.first;
+      return rmap;
+    };
+
+    const double pi = M_PI;
+    const double e = M_E;
+
+    const std::map<std::string, Operator::Type> token_to_operator {
+      {",",  Operator::Sep},
+      {"&",  Operator::And},
+      {"|",  Operator::Or},
+      {"^",  Operator::Xor},
+      {">>", Operator::Rsh},
+      {"<<", Operator::Lsh},
+      {"+",  Operator::Add},
+      {"-",  Operator::Sub},
+      {"*",  Operator::Mul},
+      {"/",  Operator::Div},
+      {"%",  Operator::Rem},
+      {"**", Operator::Exp},
+      {"~",  Operator::Not},
+      {"(",  Operator::Lbr},
+      {")",  Operator::Rbr}
+    };
+    const std::map<Operator::Type, Operator::Type> operator_as_unary {
+      {Operator::Add, Operator::Pos},
+      {Operator::Sub, Operator::Neg}
+    };
+    const std::map<Operator::Type, std::string> operator_to_token = ([]() {
+      auto map = invert_map(token_to_operator);
+      map[Operator::Pos] = "+:";
+      map[Operator::Neg] = "-:";
+      map[Operator::Fn]  = ":(";
+      return map;
+    })();
+
+    // Operators indexed by their first character: single[c] is the one-character
+    // operator c, twice[c] the operator spelled cc (such as ** or <<).
+    const struct OperatorTable {
+      Operator::Type single[256], twice[256];
+
+      OperatorTable(const std::map<std::string, Operator::Type> &tokens) {
+        std::fill(single, single + 256, Operator::Noop);
+        std::fill(twice, twice + 256, Operator::Noop);
+        for (auto &kv : tokens)
+          (kv.first.length() == 1 ? single : twice)[(unsigned char)kv.first[0]] = kv.second;
+      }
+    } operator_table(token_to_operator);
+
+    const std::map<std::string, Function::Type> token_to_function {
+      {"abs",   Function::Abs},
+      {"acos",  Function::Acos},
+      {"acosh", Function::Acosh},
+      {"asin",  Function::Asin},
+      {"asinh", Function::Asinh},
+      {"atan",  Function::Atan},
+      {"atanh", Function::Atanh},
+      {"atan2", Function::Atan2},
+      {"cbrt",  Function::Cbrt},
+      {"ceil",  Function::Ceil},
+      {"cos",   Function::Cos},
+      {"cosh",  Function::Cosh},
+      {"exp",   Function::Exp},
+      {"floor", Function::Floor},
+      {"round", Function::Round},
+      {"hypot", Function::Hypot},
+      {"log",   Function::Log},
+      {"log2",  Function::Log2},
+      {"log10", Function::Log10},
+      {"max",   Function::Max},
+      {"min",   Function::Min},
+      {"pow",   Function::Pow},
+      {"sin",   Function::Sin},
+      {"sinh",  Function::Sinh},
+      {"sqrt",  Function::Sqrt},
+      {"tan",   Function::Tan},
+      {"tanh",  Function::Tanh},
+      {"trunc", Function::Trunc}
+    };
+    const std::map<Function::Type, std::string> function_to_token = invert_map(token_to_function);
+    // Perfect hash over the lowercased names in token_to_function, so the lexer can
+    // resolve an identifier without building a std::string for it. The seed is
+    // searched once at startup until every name lands in a slot of its own.
+    class FunctionTable {
+      static const unsigned int bits = 6, size = 1 << bits;
+      const std::pair<const std::string, Function::Type> *slots[size];
+      uint32_t seed;
+      size_t max_length;
+
+      static unsigned int hash(const char *s, size_t n, uint32_t seed) {
+        uint32_t h = seed;
+        for (size_t i = 0; i < n; i++)
+          h = (h ^ (unsigned char)tolower(s[i])) * 16777619u;
+        return h >> (32 - bits);
+      }
+
+     public:
+      FunctionTable(const std::map<std::string, Function::Type> &names): seed(2166136261u), max_length(0) {
+        for (auto &kv : names)
+          max_length = std::max(max_length, kv.first.length());
+        for (;; seed++) {
+          std::fill(slots, slots + size, nullptr);
+          bool placed = true;
+          for (auto &kv : names) {
+            auto &slot = slots[hash(kv.first.data(), kv.first.length(), seed)];
+            if (slot) { placed = false; break; }
+            slot = &kv;
+          }
+          if (placed) break;
+        }
+      }
+
+      bool find(const char *s, size_t n, Function::Type &out) const {
+        if (n > max_length)
+          return false;
+        auto slot = slots[hash(s, n, seed)];
+        if (!slot || slot->first.length() != n || strncasecmp(slot->first.data(), s, n))
+          return false;
+        out = slot->second;
+        return true;
+      }
+    };
+    const FunctionTable function_table(token_to_function);
+
+    const std::map<std::string, double> const_to_value {
+      {"pi", M_PI},
+      {"e", M_E}
+    };
+
+    const std::map<Operator::Type, Function::nary<double>> operator_exec {
+      {Operator::And, [](auto &v) { return (double)(Operator::integer(v[0]) & Operator::integer(v[1])); }},
+      {Operator::Or,  [](auto &v) { return (double)(Operator::integer(v[0]) | Operator::integer(v[1])); }},
+      {Operator::Xor, [](auto &v) { return (double)(Operator::integer(v[0]) ^ Operator::integer(v[1])); }},
+      {Operator::Rsh, [](auto &v) { return (double)Operator::shift_right(Operator::integer(v[0]), Operator::integer(v[1])); }},
+      {Operator::Lsh, [](auto &v) { return (double)Operator::shift_left(Operator::integer(v[0]), Operator::integer(v[1])); }},
+      {Operator::Add, [](auto &v) { return v[0] + v[1]; }},
+      {Operator::Sub, [](auto &v) { return v[0] - v[1]; }},
+      {Operator::Mul, [](auto &v) { return v[0] * v[1]; }},
+      {Operator::Div, [](auto &v) { return v[0] / v[1]; }},
+      {Operator::Rem, [](auto &v) { return fmod(v[0], v[1]); }},
+      {Operator::Exp, [](auto &v) { return pow(v[0], v[1]); }},
+      {Operator::Not, [](auto &v) { return (double)~Operator::integer(v[0]); }},
+      {Operator::Pos, [](auto &v) { return v[0]; }},
+      {Operator::Neg, [](auto &v) { return -v[0]; }}
+    };
+    const std::map<Function::Type, Function::nary<double>> function_exec {
+      {Function::Abs,   v_1(std::abs)},
+      {Function::Acos,  v_1(std::acos)},
+      {Function::Acosh, v_1(std::acosh)},
+      {Function::Asin,  v_1(std::asin)},
+      {Function::Asinh, v_1(std::asinh)},
+      {Function::Atan,  v_1(std::atan)},
+      {Function::Atan2, v_2(std::atan2)},
+      {Function::Atanh, v_1(std::atanh)},
+      {Function::Cbrt,  v_1(std::cbrt)},
+      {Function::Ceil,  v_1(std::ceil)},
+      {Function::Cos,   v_1(std::cos)},
+      {Function::Cosh,  v_1(std::cosh)},
+      {Function::Exp,   v_1(std::exp)},
+      {Function::Floor, v_1(std::floor)},
+      {Function::Hypot, [](auto &v) { return Function::hypot(v.data(), v.size()); }},
+      {Function::Log,   v_1(std::log)},
+      {Function::Log10, v_1(std::log10)},
+      {Function::Log2,  v_1(std::log2)},
+      {Function::Max,   [](auto &v) { return Function::tree(v.data(), v.size(), Function::max); }},
+      {Function::Min,   [](auto &v) { return Function::tree(v.data(), v.size(), Function::min); }},
+      {Function::Pow,   v_2(std::pow)},
+      {Function::Round, v_1(std::round)},
+      {Function::Sin,   v_1(std::sin)},
+      {Function::Sinh,  v_1(std::sinh)},
+      {Function::Sqrt,  v_1(std::sqrt)},
+      {Function::Tan,   v_1(std::tan)},
+      {Function::Tanh,  v_1(std::tanh)},
+      {Function::Trunc, v_1(std::trunc)}
+    };
+    // The functions of fixed arity in single precision, as Float32 code calls
+    // them; hypot, max and min are computed in double either way.
+    const std::map<Function::Type, Function::nary<double>> single_exec {
+      {Function::Abs,   f_1(std::abs)},
+      {Function::Acos,  f_1(std::acos)},
+      {Function::Acosh, f_1(std::acosh)},
+      {Function::Asin,  f_1(std::asin)},
+      {Function::Asinh, f_1(std::asinh)},
+      {Function::Atan,  f_1(std::atan)},
+      {Function::Atan2, f_2(std::atan2)},
+      {Function::Atanh, f_1(std::atanh)},
+      {Function::Cbrt,  f_1(std::cbrt)},
+      {Function::Ceil,  f_1(std::ceil)},
+      {Function::Cos,   f_1(std::cos)},
+      {Function::Cosh,  f_1(std::cosh)},
+      {Function::Exp,   f_1(std::exp)},
+      {Function::Floor, f_1(std::floor)},
+      {Function::Log,   f_1(std::log)},
+      {Function::Log10, f_1(std::log10)},
+      {Function::Log2,  f_1(std::log2)},
+      {Function::Pow,   f_2(std::pow)},
+      {Function::Round, f_1(std::round)},
+      {Function::Sin,   f_1(std::sin)},
+      {Function::Sinh,  f_1(std::sinh)},
+      {Function::Sqrt,  f_1(std::sqrt)},
+      {Function::Tan,   f_1(std::tan)},
+      {Function::Tanh,  f_1(std::tanh)},
+      {Function::Trunc, f_1(std::trunc)}
+    };
+  }
+
+  // A token is a small trivially copyable value: the type tag, the argument
+  // count of a function and one of the operator, function or value payloads.
+  class Token {
+   public:
+    enum Type {
+      Value = 1,
+      Operator = 2,
+      Function = 3,
+      Constant = 4,
+      Whitespace = 5,
+      Invalid = 6,
+      Variable = 7,
+      Store = 8,
+      Load = 9,
+      Output = 10
+    };
+
+   private:
+    Type _type;
+    int _argc;
+    union {
+      Operator::Type _operator;
+      Function::Type _function;
+      double _value;
+      unsigned int _slot;
+      unsigned int _temp;
+      unsigned int _output;
+    };
+
+   public:
+    Token(double _value): _type(Token::Value), _argc(0), _value(_value) {}
+    Token(Operator::Type _operator): _type(Token::Operator), _argc(0), _operator(_operator) {}
+    Token(Function::Type _function, int _argc = 0): _type(Token::Function), _argc(_argc), _function(_function) {}
+
+    static Token variable(unsigned int slot) {
+      Token token(0.0);
+      token._type = Token::Variable;
+      token._slot = slot;
+      return token;
+    }
+
+    // Copies the top of the stack into a temporary, leaving it in place.
+    static Token store(unsigned int temp) {
+      Token token(0.0);
+      token._type = Token::Store;
+      token._temp = temp;
+      return token;
+    }
+
+    // Pushes a temporary saved earlier by store.
+    static Token load(unsigned int temp) {
+      Token token(0.0);
+      token._type = Token::Load;
+      token._temp = temp;
+      return token;
+    }
+
+    // Pops the top of the stack into output k of a program with several.
+    static Token output(unsigned int k) {
+      Token token(0.0);
+      token._type = Token::Output;
+      token._output = k;
+      return token;
+    }
+
+    bool is_value() const {
+      return this->_type == Token::Value;
+    }
+
+    bool is_operator() const {
+      return this->_type == Token::Operator;
+    }
+
+    bool is_function() const {
+      return this->_type == Token::Function;
+    }
+
+    bool is_variable() const {
+      return this->_type == Token::Variable;
+    }
+
+    bool is_store() const {
+      return this->_type == Token::Store;
+    }
+
+    bool is_load() const {
+      return this->_type == Token::Load;
+    }
+
+    bool is_output() const {
+      return this->_type == Token::Output;
+    }
+
+    bool is_sentinel() const {
+      return this->is_operator() && Operator::sentinel(this->_operator);
+    }
+
+    double value() const {
+      return this->is_value() ? this->_value : 0.0;
+    }
+
+    unsigned int slot() const {
+      return this->is_variable() ? this->_slot : 0;
+    }
+
+    unsigned int temp() const {
+      return this->is_store() || this->is_load() ? this->_temp : 0;
+    }
+
+    unsigned int output() const {
+      return this->is_output() ? this->_output : 0;
+    }
+
+    Operator::Type operator_() const {
+      return this->is_operator() ? this->_operator : Operator::Noop;
+    }
+
+    Function::Type function() const {
+      return this->is_function() ? this->_function : Function::Pass;
+    }
+
+    unsigned int operator_arity() const {
+      return Operator::arity(this->_operator);
+    }
+
+    unsigned int operator_precedence() const {
+      return Operator::precedence(this->_operator);
+    }
+
+    int function_arity() const {
+      return Function::arity(this->_function);
+    }
+
+    void function_init_argc() {
+      if (this->is_function() && !this->_argc)
+        this->_argc++;
+    }
+
+    void function_increase_argc() {
+      if (this->is_function())
+        this->_argc++;
+    }
+
+    int function_argc() const {
+      return this->is_function() ? this->_argc : 0;
+    }
+
+    std::string to_string() const {
+      if (this->is_value()) {
+        char buf[50];
+        sprintf(buf, "%.3lf", this->_value);
+        return std::string(buf);
+      } else if (this->is_variable()) {
+        return "$" + std::to_string(this->_slot);
+      } else if (this->is_store()) {
+        return "->t" + std::to_string(this->_temp);
+      } else if (this->is_load()) {
+        return "t" + std::to_string(this->_temp);
+      } else if (this->is_output()) {
+        return "->o" + std::to_string(this->_output);
+      } else if (this->is_operator()) {
+        auto it = operator_to_token.find(this->_operator);
+        if (it != operator_to_token.end())
+          return it->second;
+      } else if (this->is_function()) {
+        auto it = function_to_token.find(this->_function);
+        if (it != function_to_token.end())
+          return it->second;
+      }
+      return "";
+    }
+  };
+  static_assert(std::is_trivially_copyable<Token>::value, "tokens are copied around by value");
+  static_assert(sizeof(Token) == 16, "tokens are packed into 16 bytes");
+
+  typedef std::vector<Token> TokenizedExpr;
+
+  // Names of the input slots an expression reads, indexed by slot.
+  typedef std::vector<std::string> Variables;
+
+  // A validated postfix expression. It is built once, by shunting_yard or from
+  // any other postfix sequence through create(), and never changes afterwards,
+  // so one program can be evaluated any number of times and from several
+  // threads at once. Besides the stack, a program may keep values it needs
+  // more than once in temporaries (Store/Load tokens). A fused program
+  // computes several expressions at once and pops each result into an
+  // output of its own (Output tokens) instead of leaving one value.
+  class Program {
+    TokenizedExpr _code;
+    size_t _depth;
+    size_t _slots;
+    size_t _temps;
+    size_t _outputs;
+
+   public:
+    Program(): _depth(0), _slots(0), _temps(0), _outputs(0) {}
+
+    // Checks that every operator and function finds its arguments on the stack,
+    // that temporaries are stored before they are loaded and that exactly one
+    // value is left, or none if every result went to an output, recording the
+    // deepest stack reached, how many input slots are read and how many
+    // temporaries and outputs are used.
+    static bool create(TokenizedExpr code, Program &out) {
+      size_t size = 0, depth = 0, slots = 0, outputs = 0;
+      arena::Vector<bool> stored;
+      for (auto &token : code) {
+        if (token.is_output()) {
+          if (!size) {
+            fprintf(diagnostics, "Syntax error\n");
+            return false;
+          }
+          outputs = std::max(outputs, (size_t)token.output() + 1);
+          size--;
+          continue;
+        }
+        if (token.is_store()) {
+          if (!size) {
+            fprintf(diagnostics, "Syntax error\n");
+            return false;
+          }
+          if (token.temp() >= stored.size())
+            stored.resize(token.temp() + 1);
+          stored[token.temp()] = true;
+          continue;
+        }
+        if (token.is_load() && (token.temp() >= stored.size() || !stored[token.temp()])) {
+          fprintf(diagnostics, "Syntax error\n");
+          return false;
+        }
+        size_t n = token.is_operator() ? token.operator_arity() : token.function_argc();
+        if (n > size || (token.is_function() && token.function_arity() > (int)n)) {
+          fprintf(diagnostics, "Syntax error\n");
+          return false;
+        }
+        if (token.is_variable())
+          slots = std::max(slots, (size_t)token.slot() + 1);
+        size = size - n + 1;
+        depth = std::max(depth, size);
+      }
+      if (size != (outputs ? 0 : 1)) {
+        fprintf(diagnostics, "Syntax error\n");
+        return false;
+      }
+      out._outputs = outputs;
+      out._code = std::move(code);
+      out._depth = depth;
+      out._slots = slots;
+      out._temps = stored.size();
+      return true;
+    }
+
+    const TokenizedExpr &code() const {
+      return this->_code;
+    }
+
+    // Takes the code back out, leaving the program empty, so that the next
+    // program built into it can reuse its buffer.
+    TokenizedExpr recycle() {
+      this->_depth = this->_slots = this->_temps = this->_outputs = 0;
+      return std::move(this->_code);
+    }
+
+    size_t depth() const {
+      return this->_depth;
+    }
+
+    size_t slots() const {
+      return this->_slots;
+    }
+
+    size_t temps() const {
+      return this->_temps;
+    }
+
+    // 0 for a program that leaves its one result on the stack.
+    size_t outputs() const {
+      return this->_outputs;
+    }
+  };
+
+  namespace {
+    bool is_digit(const char *p, const char *end) {
+      return p < end && isdigit((unsigned char)*p);
+    }
+
+    // Scans (\d+(\.\d*)?|\.\d+)([eE][+-]?\d+)? and returns its end, or begin
+    // when there is no number there.
+    const char *scan_number(const char *p, const char *end) {
+      const char *begin = p;
+      if (is_digit(p, end)) {
+        while (is_digit(p, end)) p++;
+        if (p < end && *p == '.')
+          for (p++; is_digit(p, end); p++);
+      } else if (p < end && *p == '.' && is_digit(p + 1, end)) {
+        for (p++; is_digit(p, end); p++);
+      } else return begin;
+      if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        if (q < end && (*q == '+' || *q == '-')) q++;
+        if (is_digit(q, end)) {
+          while (is_digit(q, end)) q++;
+          p = q;
+        }
+      }
+      return p;
+    }
+
+    double to_double(const char *begin, const char *end) {
+      char *stop;
+      double value = strtod(begin, &stop);
+      if (stop == end)
+        return value;
+      // strtod reads further than our grammar does (hex prefixes); parse a bounded copy
+      return strtod(std::string(begin, end).c_str(), nullptr);
+    }
+
+    const char *scan_operator(const char *p, const char *end, Operator::Type &out) {
+      const unsigned char c = *p;
+      if (p + 1 < end && p[1] == c && operator_table.twice[c] != Operator::Noop) {
+        out = operator_table.twice[c];
+        return p + 2;
+      }
+      if (operator_table.single[c] != Operator::Noop) {
+        out = operator_table.single[c];
+        return p + 1;
+      }
+      return p;
+    }
+
+    const char *scan_identifier(const char *p, const char *end) {
+      if (!isalpha((unsigned char)*p) && *p != '_')
+        return p;
+      const char *q = p + 1;
+      while (q < end && (isalnum((unsigned char)*q) || *q == '_')) q++;
+      return q;
+    }
+
+    // A function name only matches as a whole identifier followed by a bracket.
+    const char *scan_function(const char *p, const char *end, Function::Type &out) {
+      const char *q = scan_identifier(p, end);
+      const char *r = q;
+      while (r < end && isspace((unsigned char)*r)) r++;
+      if (q != p && r < end && *r == '(' && function_table.find(p, q - p, out))
+        return q;
+      return p;
+    }
+
+    bool find_constant(const char *p, size_t n, double &out) {
+      for (auto &kv : const_to_value)
+        if (kv.first.length() == n && !strncasecmp(p, kv.first.data(), n)) {
+          out = kv.second;
+          return true;
+        }
+      return false;
+    }
+
+    // Returns the slot of the variable spelled [p, p + n), appending it to the
+    // table on first use.
+    unsigned int bind_variable(const char *p, size_t n, Variables &variables) {
+      for (size_t i = 0; i < variables.size(); i++)
+        if (variables[i].length() == n && !variables[i].compare(0, n, p, n))
+          return i;
+      variables.emplace_back(p, n);
+      return variables.size() - 1;
+    }
+
+    const char *scan_whitespace(const char *p, const char *end) {
+      while (p < end && isspace((unsigned char)*p)) p++;
+      return p;
+    }
+  }
+
+  // Identifiers that are neither functions nor constants are variables. They are
+  // looked up in (and if new, appended to) variables, so a caller may bind names
+  // to particular slots beforehand.
+  bool parse_infix(const std::string &expr, TokenizedExpr &infix, Variables &variables) {
+    stats::Timer timer(stats::Tokenize);
+    const char *begin = expr.c_str(), *end = begin + expr.length();
+    infix.reserve(infix.size() + expr.length() / 2);
+    for (const char *p = begin, *q; p < end; p = q) {
+      Operator::Type operator_;
+      Function::Type function;
+      double value;
+      if ((q = scan_number(p, end)) != p)
+        infix.push_back(Token(to_double(p, q)));
+      else if ((q = scan_operator(p, end, operator_)) != p) {
+        if ((infix.empty() || (!infix.back().is_value() && !infix.back().is_variable() &&
+                               infix.back().operator_() != Operator::Rbr)) &&
+            operator_as_unary.find(operator_) != operator_as_unary.end())
+          operator_ = operator_as_unary.at(operator_);
+        if (!infix.empty() && infix.back().is_function())
+          operator_ = Operator::Fn;
+        infix.push_back(Token(operator_));
+      } else if ((q = scan_function(p, end, function)) != p)
+        infix.push_back(Token(function));
+      else if ((q = scan_identifier(p, end)) != p) {
+        if (find_constant(p, q - p, value))
+          infix.push_back(Token(value));
+        else
+          infix.push_back(Token::variable(bind_variable(p, q - p, variables)));
+      }
+      else if ((q = scan_whitespace(p, end)) == p) {
+        fprintf(diagnostics, "Invalid character '%c' at position %ld\n", *p, (long)(p - begin));
+        return false;
+      }
+    }
+    if (debug) {
+      for (auto &t : infix)
+        fprintf(diagnostics, "%s ", t.to_string().c_str());
+      fputc('\n', diagnostics);
+    }
+    return true;
+  }
+
+  bool parse_infix(const std::string &expr, TokenizedExpr &infix) {
+    Variables variables;
+    return parse_infix(expr, infix, variables);
+  }
+
+  // The program's old code buffer is reused for the new one, so program is left
+  // empty if infix does not parse.
+  bool shunting_yard(const TokenizedExpr &infix, Program &program) {
+    stats::Timer timer(stats::ShuntingYard);
+    std::stack<Token, arena::Vector<Token>> operator_cache, function_cache;
+    auto postfix = program.recycle();
+    postfix.clear();
+    postfix.reserve(infix.size());
+    for (auto &token : infix) {
+      if (token.is_value() || token.is_variable()) {
+        if (!function_cache.empty())
+          function_cache.top().function_init_argc();
+        postfix.push_back(token);
+      } else if (token.is_function()) {
+        if (!function_cache.empty())
+          function_cache.top().function_init_argc();
+        function_cache.push(token);
+      } else if (token.is_operator()) {
+        if (token.is_sentinel())
+          operator_cache.push(token);
+        else if (token.operator_() == Operator::Rbr) {
+          while (true) {
+            if (operator_cache.empty()) {
+              fprintf(diagnostics, "Parentheses are mismatched\n");
+              return false;
+            }
+            auto op = operator_cache.top(); operator_cache.pop();
+            if (op.operator_() == Operator::Fn) {
+              postfix.push_back(function_cache.top());
+              function_cache.pop();
+              break;
+            } else if (op.operator_() == Operator::Lbr)
+              break;
+            else postfix.push_back(op);
+          }
+        } else {
+          if (token.operator_arity() != 1)
+            while (!operator_cache.empty() && !operator_cache.top().is_sentinel()) {
+              auto op = operator_cache.top();
+              if (token.operator_precedence() > op.operator_precedence())
+                break;
+              operator_cache.pop();
+              postfix.push_back(op);
+            }
+          if (token.operator_() != Operator::Sep)
+            operator_cache.push(token);
+          else if (function_cache.empty()) {
+            fprintf(diagnostics, "Separator outside function\n");
+            return false;
+          } else function_cache.top().function_increase_argc();
+        }
+      }
+    }
+    while (!operator_cache.empty()) {
+      auto op = operator_cache.top();
+      if (op.is_sentinel()) {
+        fprintf(diagnostics, "Parentheses are mismatched\n");
+        return false;
+      }
+      postfix.push_back(op);
+      operator_cache.pop();
+    }
+    if (!function_cache.empty()) {
+      fprintf(diagnostics, "Syntax error\n");
+      return false;
+    }
+    if (debug) {
+      for (auto &t : postfix)
+        fprintf(diagnostics, "%s ", t.to_string().c_str());
+      fputc('\n', diagnostics);
+    }
+    return Program::create(std::move(postfix), program);
+  }
+
+  // The results of a fused program go to output(k, value) rather than out.
+  template<typename T>
+  bool eval(
+      const Program &program, T &out,
+      std::function<T(double)> mapper,
+      std::function<T(unsigned int)> loader,
+      std::function<T(Operator::Type, arena::Vector<T>&)> operator_exec,
+      std::function<T(Function::Type, arena::Vector<T>&)> function_exec,
+      std::function<void(unsigned int, T)> output = nullptr) {
+    // the program is validated, so the stack can be sized up front and never
+    // underflows; the argument vector is reused across tokens
+    arena::Vector<T> result, values, temps(program.temps());
+    result.reserve(program.depth());
+    for (auto &token : program.code()) {
+      if (token.is_value())
+        result.push_back(mapper(token.value()));
+      else if (token.is_variable())
+        result.push_back(loader(token.slot()));
+      else if (token.is_store())
+        temps[token.temp()] = result.back();
+      else if (token.is_load())
+        result.push_back(temps[token.temp()]);
+      else if (token.is_output()) {
+        output(token.output(), result.back());
+        result.pop_back();
+      } else if (token.is_operator()) {
+        size_t n = token.operator_arity();
+        values.assign(result.end() - n, result.end());
+        result.erase(result.end() - n, result.end());
+        result.push_back(operator_exec(token.operator_(), values));
+      } else if (token.is_function()) {
+        size_t n = token.function_argc();
+        values.assign(result.end() - n, result.end());
+        result.erase(result.end() - n, result.end());
+        result.push_back(function_exec(token.function(), values));
+      }
+    }
+    if (!result.empty())
+      out = result.back();
+    return true;
+  }
+
+  // vars holds one value per slot of the program. Every result is kept as a
+  // double, so bit operators agree with the other backends only while what
+  // they compute stays within 2**53.
+  bool eval(const Program &program, double &out, const double *vars = nullptr) {
+    return eval<double>(
+      program,
+      out,
+      [](auto a) { return a; },
+      [&](auto slot) { return vars[slot]; },
+      [&](auto op, auto &v) { return operator_exec.at(op)(v); },
+      [&](auto fn, auto &v) { return function_exec.at(fn)(v); });
+  }
+
+  // Runs a fused program, writing output k to outputs[k].
+  bool eval(const Program &program, double *outputs, const double *vars = nullptr) {
+    double out;
+    return eval<double>(
+      program,
+      out,
+      [](auto a) { return a; },
+      [&](auto slot) { return vars[slot]; },
+      [&](auto op, auto &v) { return operator_exec.at(op)(v); },
+      [&](auto fn, auto &v) { return function_exec.at(fn)(v); },
+      [&](auto k, auto v) { outputs[k] = v; });
+  }
+}
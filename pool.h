@@ -0,0 +1,127 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pool {
+  // A fixed set of worker threads, each with a queue of its own. A run hands
+  // every worker a contiguous range of tasks; a worker takes tasks from the
+  // front of its own queue and, once it runs dry, steals from the back of the
+  // others, so uneven tasks still keep every thread busy. The calling thread
+  // works too, so a pool of one thread runs everything inline.
+  class Pool {
+    struct Queue {
+      std::mutex lock;
+      std::deque<size_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)> *job = nullptr;
+    size_t generation = 0, pending = 0;
+    bool stopping = false;
+
+    bool take(size_t self, size_t &task) {
+      for (size_t k = 0; k < queues.size(); k++) {
+        auto &queue = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+          continue;
+        if (k == 0) {
+          task = queue.tasks.front();
+          queue.tasks.pop_front();
+        } else {
+          task = queue.tasks.back();
+          queue.tasks.pop_back();
+        }
+        return true;
+      }
+      return false;
+    }
+
+    void work(size_t self) {
+      size_t task;
+      while (this->take(self, task)) {
+        (*job)(task);
+        std::lock_guard<std::mutex> guard(lock);
+        if (!--pending)
+          done.notify_all();
+      }
+    }
+
+    void loop(size_t self) {
+      size_t seen = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          wake.wait(guard, [&]() { return stopping || generation != seen; });
+          if (stopping)
+            return;
+          seen = generation;
+        }
+        this->work(self);
+      }
+    }
+
+   public:
+    // threads counts the calling thread; 0 means one per hardware thread.
+    explicit Pool(unsigned int threads = 0) {
+      if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+      for (unsigned int i = 0; i < threads; i++)
+        queues.push_back(std::make_unique<Queue>());
+      for (unsigned int i = 1; i < threads; i++)
+        workers.emplace_back([this, i]() { this->loop(i); });
+    }
+
+    ~Pool() {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (auto &worker : workers)
+        worker.join();
+    }
+
+    Pool(const Pool&) = delete;
+    Pool &operator=(const Pool&) = delete;
+
+    size_t size() const {
+      return queues.size();
+    }
+
+    // Calls fn(task) for every task in [0, tasks) and returns once all are done.
+    // Runs must not overlap.
+    void run(size_t tasks, const std::function<void(size_t)> &fn) {
+      if (!tasks)
+        return;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        job = &fn;
+        pending = tasks;
+      }
+      // a worker still busy stealing may pick tasks up as soon as they are queued
+      for (size_t q = 0; q < queues.size(); q++) {
+        std::lock_guard<std::mutex> guard(queues[q]->lock);
+        for (size_t task = q * tasks / queues.size(); task < (q + 1) * tasks / queues.size(); task++)
+          queues[q]->tasks.push_back(task);
+      }
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        generation++;
+      }
+      wake.notify_all();
+      this->work(0);
+      std::unique_lock<std::mutex> guard(lock);
+      done.wait(guard, [&]() { return !pending; });
+    }
+  };
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "pool.h"
+#include "vm.h"
+
+namespace server {
+  // A frame is a little-endian uint32_t length and that many bytes. A request
+  // frame holds a uint32_t count and count requests, each the uint32_t length
+  // of an expression, its text, the uint32_t number of inputs per row, the
+  // uint32_t number of rows and then every row, one double per variable in
+  // order of first appearance. The response frame holds the count and, for
+  // every request in order, the uint32_t number of rows and one double per
+  // row, or failed in place of the rows of a request that did not evaluate.
+  const uint32_t failed = 0xffffffff;
+
+  // Request frames past this size close the connection rather than being
+  // buffered; a request whose results would take the response past it fails.
+  const size_t max_frame = 64 << 20;
+
+  // One request of a frame, as decoded, and its results once evaluated.
+  struct Request {
+    std::string expression;
+    uint32_t inputs = 0, rows = 0;
+    std::vector<double> values;
+    // valid if ok
+    std::vector<double> results;
+    bool ok = false;
+    // the response has no room for the results
+    bool rejected = false;
+  };
+
+  namespace {
+    // Reads a frame's payload, every read checked against its end.
+    struct Cursor {
+      const char *at, *end;
+
+      bool read(void *out, size_t n) {
+        if ((size_t)(end - at) < n)
+          return false;
+        memcpy(out, at, n);
+        at += n;
+        return true;
+      }
+    };
+
+    bool decode(const char *payload, size_t size, std::vector<Request> &out) {
+      Cursor cursor { payload, payload + size };
+      uint32_t count;
+      if (!cursor.read(&count, sizeof(count)))
+        return false;
+      // every request takes at least its three lengths on the wire, and far
+      // more once decoded, so a frame holds at most max_frame bytes of them
+      if (count > size / 12 || count > max_frame / sizeof(Request))
+        return false;
+      out.clear();
+      size_t response = sizeof(uint32_t) + count * sizeof(uint32_t);
+      for (uint32_t i = 0; i < count; i++) {
+        auto &request = out.emplace_back();
+        uint32_t length;
+        if (!cursor.read(&length, sizeof(length)) || (size_t)(cursor.end - cursor.at) < length)
+          return false;
+        request.expression.assign(cursor.at, length);
+        cursor.at += length;
+        if (!cursor.read(&request.inputs, sizeof(uint32_t)) || !cursor.read(&request.rows, sizeof(uint32_t)))
+          return false;
+        size_t values = (size_t)request.inputs * request.rows;
+        if (values > (size_t)(cursor.end - cursor.at) / sizeof(double))
+          return false;
+        // rows are not bounded by the frame when there are no inputs
+        size_t results = (size_t)request.rows * sizeof(double);
+        if (results > max_frame - response) {
+          printf("Results of %u rows do not fit in a response: %s\n", request.rows, request.expression.c_str());
+          request.rejected = true;
+          cursor.at += values * sizeof(double);
+          continue;
+        }
+        response += results;
+        request.values.resize(values);
+        cursor.read(request.values.data(), values * sizeof(double));
+      }
+      return cursor.at == cursor.end;
+    }
+
+    void put(std::vector<char> &out, const void *data, size_t n) {
+      out.insert(out.end(), (const char*)data, (const char*)data + n);
+    }
+
+    void encode(const std::vector<Request> &requests, std::vector<char> &out) {
+      size_t size = sizeof(uint32_t);
+      for (auto &request : requests)
+        size += sizeof(uint32_t) + (request.ok ? request.results.size() * sizeof(double) : 0);
+      uint32_t length = size, count = requests.size();
+      put(out, &length, sizeof(length));
+      put(out, &count, sizeof(count));
+      for (auto &request : requests) {
+        uint32_t rows = request.ok ? request.results.size() : failed;
+        put(out, &rows, sizeof(rows));
+        if (request.ok)
+          put(out, request.results.data(), request.results.size() * sizeof(double));
+      }
+    }
+  }
+
+  // A long-running evaluator on a Unix or TCP socket. One thread waits on
+  // every connection with epoll and gathers the request frames that have
+  // arrived; each round evaluates all their requests as the tasks of one run
+  // of the pool, against the cache, so an expression is parsed and compiled
+  // once for as long as it stays cached whoever sends it. Responses go back in
+  // the order of the frames of each connection.
+  class Server {
+    struct Connection {
+      int fd;
+      std::vector<char> in, out;
+      // bytes of out already sent
+      size_t sent = 0;
+      // the peer is done sending, or the connection failed
+      bool closing = false;
+      // what epoll waits for on fd
+      uint32_t events = EPOLLIN | EPOLLRDHUP;
+    };
+
+    // The requests of one frame.
+    struct Frame {
+      Connection *connection;
+      std::vector<Request> requests;
+    };
+
+    cache::Cache &cache;
+    pool::Pool &pool;
+    int listener = -1, epoll = -1, wakeup = -1;
+    std::string path;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+
+    bool watch(int fd, uint32_t events, int op = EPOLL_CTL_ADD) {
+      epoll_event event {};
+      event.events = events;
+      event.data.fd = fd;
+      if (epoll_ctl(epoll, op, fd, &event) < 0) {
+        printf("Cannot watch socket: %s\n", strerror(errno));
+        return false;
+      }
+      return true;
+    }
+
+    bool bind_unix(const std::string &address) {
+      sockaddr_un addr {};
+      if (address.length() >= sizeof(addr.sun_path)) {
+        printf("Socket path too long: %s\n", address.c_str());
+        return false;
+      }
+      addr.sun_family = AF_UNIX;
+      memcpy(addr.sun_path, address.c_str(), address.length());
+      // a socket left behind by an earlier server would fail the bind
+      struct stat st;
+      if (stat(address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(address.c_str());
+      listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Cannot bind %s: %s\n", address.c_str(), strerror(errno));
+        return false;
+      }
+      path = address;
+      return true;
+    }
+
+    bool bind_tcp(const std::string &address) {
+      auto colon = address.rfind(':');
+      // a bare port is only reachable from this host
+      std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+      std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+      addrinfo hints {}, *found;
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      if (int error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found)) {
+        printf("Cannot resolve %s: %s\n", address.c_str(), gai_strerror(error));
+        return false;
+      }
+      for (auto *ai = found; ai; ai = ai->ai_next) {
+        listener = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (listener < 0)
+          continue;
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listener, ai->ai_addr, ai->ai_addrlen) == 0)
+          break;
+        close(listener);
+        listener = -1;
+      }
+      freeaddrinfo(found);
+      if (listener < 0) {
+        printf("Cannot bind %s: %s\n", address.c_str(), strerror(errno));
+        return false;
+      }
+      return true;
+    }
+
+    void accept_all() {
+      while (true) {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            printf("Cannot accept: %s\n", strerror(errno));
+          if (errno != EINTR)
+            return;
+          continue;
+        }
+        if (!this->watch(fd, EPOLLIN | EPOLLRDHUP)) {
+          close(fd);
+          continue;
+        }
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        connections[fd] = std::move(connection);
+      }
+    }
+
+    // Reads what connection has to give and cuts complete frames off the front.
+    void receive(Connection &connection, std::vector<Frame> &frames) {
+      char buffer[65536];
+      while (!connection.closing) {
+        ssize_t n = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (n > 0)
+          connection.in.insert(connection.in.end(), buffer, buffer + n);
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+          connection.closing = true;
+        else if (errno != EINTR)
+          break;
+      }
+      size_t at = 0;
+      while (connection.in.size() - at >= sizeof(uint32_t)) {
+        uint32_t length;
+        memcpy(&length, connection.in.data() + at, sizeof(length));
+        if (length > max_frame) {
+          printf("Frame of %u bytes is too large\n", length);
+          connection.closing = true;
+          break;
+        }
+        if (connection.in.size() - at - sizeof(length) < length)
+          break;
+        Frame frame { &connection, {} };
+        if (!decode(connection.in.data() + at + sizeof(length), length, frame.requests)) {
+          printf("Malformed request frame\n");
+          connection.closing = true;
+          break;
+        }
+        frames.push_back(std::move(frame));
+        at += sizeof(length) + length;
+      }
+      connection.in.erase(connection.in.begin(), connection.in.begin() + at);
+    }
+
+    // Sends as much of the pending output as the socket takes and waits for
+    // it to drain if that is not all of it.
+    void send_pending(Connection &connection) {
+      while (connection.sent < connection.out.size()) {
+        ssize_t n = send(connection.fd, connection.out.data() + connection.sent,
+          connection.out.size() - connection.sent, MSG_NOSIGNAL);
+        if (n > 0)
+          connection.sent += n;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        else if (errno != EINTR) {
+          // the peer is gone, so what it was owed goes nowhere
+          connection.out.clear();
+          connection.sent = 0;
+          connection.closing = true;
+          return;
+        }
+      }
+      if (connection.sent == connection.out.size()) {
+        connection.out.clear();
+        connection.sent = 0;
+      }
+      // a closing connection is only waited on to drain
+      uint32_t events = (connection.closing ? 0u : EPOLLIN | EPOLLRDHUP) | (connection.out.empty() ? 0u : EPOLLOUT);
+      if (events != connection.events && this->watch(connection.fd, events, EPOLL_CTL_MOD))
+        connection.events = events;
+    }
+
+    void evaluate(Request &request) {
+      std::shared_ptr<const cache::Entry> entry;
+      if (request.rejected || !cache.get(request.expression, entry))
+        return;
+      if (request.inputs != entry->variables.size()) {
+        printf("Expected %zu inputs, got %u: %s\n", entry->variables.size(), request.inputs, request.expression.c_str());
+        return;
+      }
+      request.results.resize(request.rows);
+      for (uint32_t r = 0; r < request.rows; r++) {
+        const double *vars = request.values.data() + (size_t)r * request.inputs;
+        request.results[r] = entry->kernel ? entry->kernel(vars) : vm::run(entry->bytecode, vars, nullptr);
+      }
+      request.ok = true;
+    }
+
+   public:
+    Server(cache::Cache &cache, pool::Pool &pool): cache(cache), pool(pool) {}
+
+    Server(const Server&) = delete;
+    Server &operator=(const Server&) = delete;
+
+    ~Server() {
+      for (auto &it : connections)
+        close(it.first);
+      for (int fd : { listener, epoll, wakeup })
+        if (fd >= 0)
+          close(fd);
+      if (!path.empty())
+        unlink(path.c_str());
+    }
+
+    // Listens on address: a path, if it has a '/', is a Unix socket; otherwise
+    // it is HOST:PORT, or a PORT on the loopback interface.
+    bool listen(const std::string &address) {
+      if (!(address.find('/') != std::string::npos ? this->bind_unix(address) : this->bind_tcp(address)))
+        return false;
+      if (::listen(listener, SOMAXCONN) < 0) {
+        printf("Cannot listen on %s: %s\n", address.c_str(), strerror(errno));
+        return false;
+      }
+      epoll = epoll_create1(EPOLL_CLOEXEC);
+      wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (epoll < 0 || wakeup < 0) {
+        printf("Cannot start the event loop: %s\n", strerror(errno));
+        return false;
+      }
+      return this->watch(listener, EPOLLIN) && this->watch(wakeup, EPOLLIN);
+    }
+
+    // Serves connections until stop().
+    bool run() {
+      std::vector<epoll_event> events(256);
+      std::vector<Frame> frames;
+      std::vector<Request*> requests;
+      std::vector<Connection*> ready;
+      while (true) {
+        int n = epoll_wait(epoll, events.data(), events.size(), -1);
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          printf("Cannot wait for sockets: %s\n", strerror(errno));
+          return false;
+        }
+        for (int i = 0; i < n; i++) {
+          int fd = events[i].data.fd;
+          if (fd == wakeup)
+            return true;
+          if (fd == listener) {
+            this->accept_all();
+            continue;
+          }
+          auto &connection = *connections[fd];
+          if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            this->receive(connection, frames);
+          ready.push_back(&connection);
+        }
+        // every request that arrived this round is one task of one run
+        requests.clear();
+        for (auto &frame : frames)
+          for (auto &request : frame.requests)
+            requests.push_back(&request);
+        pool.run(requests.size(), [&](size_t task) { this->evaluate(*requests[task]); });
+        for (auto &frame : frames)
+          encode(frame.requests, frame.connection->out);
+        for (auto *connection : ready)
+          this->send_pending(*connection);
+        frames.clear();
+        ready.clear();
+        for (auto it = connections.begin(); it != connections.end();)
+          if (it->second->closing && it->second->out.empty()) {
+            close(it->first);
+            it = connections.erase(it);
+          } else ++it;
+      }
+    }
+
+    // Makes run() return; safe to call from a signal handler.
+    void stop() {
+      uint64_t one = 1;
+      if (write(wakeup, &one, sizeof(one)) < 0)
+        return;
+    }
+  };
+}
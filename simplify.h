@@ -0,0 +1,377 @@
+#pragma once
+
+#include <cstring>
+#include <unordered_map>
+
+#include "arena.h"
+#include "parser.h"
+#include "stats.h"
+
+namespace simplify {
+  namespace {
+    using parser::Token;
+    namespace Operator = parser::Operator;
+    namespace Function = parser::Function;
+
+    typedef arena::Vector<size_t> Args;
+
+    // An expression node: a value or variable leaf, or an operator or function
+    // applied to earlier nodes. hash identifies the subexpression, so neither
+    // canonical ordering nor hash-consing ever has to walk it.
+    struct Node {
+      Token token;
+      Args args;
+      uint64_t hash;
+    };
+
+    uint64_t mix(uint64_t h, uint64_t v) {
+      h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+      return h * 0xff51afd7ed558ccdull;
+    }
+
+    uint64_t token_bits(const Token &token) {
+      if (token.is_value()) {
+        uint64_t bits;
+        double value = token.value();
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+      }
+      if (token.is_variable())
+        return token.slot();
+      return token.is_operator() ? (uint64_t)token.operator_() : (uint64_t)token.function();
+    }
+
+    bool same(const Token &a, const Token &b) {
+      return a.is_value() == b.is_value() && a.is_variable() == b.is_variable() &&
+        a.is_operator() == b.is_operator() && token_bits(a) == token_bits(b) &&
+        a.function_argc() == b.function_argc();
+    }
+
+    bool is_constant(const Token &token, double value) {
+      return token.is_value() && token.value() == value;
+    }
+
+    bool commutative(const Token &token) {
+      switch (token.operator_()) {
+        case Operator::Add: case Operator::Mul:
+        case Operator::And: case Operator::Or: case Operator::Xor:
+          return true;
+        default:
+          return token.function() == Function::Max || token.function() == Function::Min;
+      }
+    }
+
+    // The expression as a DAG: nodes are hash-consed, so every distinct
+    // subexpression exists once however often it is written.
+    class Tree {
+      arena::Vector<Node> nodes;
+      std::unordered_multimap<uint64_t, size_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+        arena::Allocator<std::pair<const uint64_t, size_t>>> index;
+      // constants fold as the program will compute them
+      bool single;
+
+      // Variables first, then compound nodes, then constants last, so that
+      // x + 1 and 1 + x come out the same.
+      int rank(size_t i) const {
+        return nodes[i].token.is_variable() ? 0 : nodes[i].token.is_value() ? 2 : 1;
+      }
+
+      bool before(size_t a, size_t b) const {
+        if (rank(a) != rank(b))
+          return rank(a) < rank(b);
+        if (nodes[a].token.is_variable())
+          return nodes[a].token.slot() < nodes[b].token.slot();
+        if (nodes[a].token.is_value())
+          return nodes[a].token.value() < nodes[b].token.value();
+        return nodes[a].hash < nodes[b].hash;
+      }
+
+      size_t add(Token token, Args args) {
+        uint64_t hash = mix(token_bits(token), token.is_value() ? 1 : token.is_variable() ? 2 : 3);
+        for (auto arg : args)
+          hash = mix(hash, nodes[arg].hash);
+        auto range = index.equal_range(hash);
+        for (auto it = range.first; it != range.second; it++)
+          if (same(nodes[it->second].token, token) && nodes[it->second].args == args) {
+            if (!args.empty())
+              merged++;
+            return it->second;
+          }
+        nodes.push_back({ token, std::move(args), hash });
+        index.emplace(hash, nodes.size() - 1);
+        return nodes.size() - 1;
+      }
+
+      size_t value(double v) {
+        return this->add(Token(v), {});
+      }
+
+      bool constant_args(const Args &args) const {
+        for (auto arg : args)
+          if (!nodes[arg].token.is_value())
+            return false;
+        return true;
+      }
+
+      // Evaluates token over constant arguments with the interpreter's tables.
+      // In Float32 mode constants and results are rounded to float and the
+      // functions of fixed arity run in single precision, as the backends do.
+      double fold(const Token &token, const Args &args) const {
+        arena::Vector<double> values;
+        for (auto arg : args)
+          values.push_back(single ? (float)nodes[arg].token.value() : nodes[arg].token.value());
+        if (!single) {
+          if (token.is_operator())
+            return parser::operator_exec.at(token.operator_())(values);
+          return parser::function_exec.at(token.function())(values);
+        }
+        if (token.operator_() == Operator::Exp)
+          return (float)std::pow((float)values[0], (float)values[1]);
+        if (token.is_operator())
+          return (float)parser::operator_exec.at(token.operator_())(values);
+        if (Function::arity(token.function()) >= 0)
+          return parser::single_exec.at(token.function())(values);
+        return (float)parser::function_exec.at(token.function())(values);
+      }
+
+      // The backends keep the results of bit operators as integers, so one
+      // folds into a constant only while the double holding it is exact, or
+      // the float in Float32 mode, where constants are rounded to float.
+      bool exact(const Token &token, double folded) const {
+        if (!token.is_operator() || !Operator::bitwise(token.operator_()))
+          return true;
+        return single ? std::abs(folded) < 16777216.0 : std::abs(folded) < 9007199254740992.0;
+      }
+
+      size_t apply_variadic(Token token, Args args) {
+        // hypot(a, hypot(b, c)) and the like become a single call
+        Args flat;
+        for (auto arg : args)
+          if (nodes[arg].token.function() == token.function())
+            flat.insert(flat.end(), nodes[arg].args.begin(), nodes[arg].args.end());
+          else flat.push_back(arg);
+        if (token.function() != Function::Hypot) {
+          // max and min of several constants are one constant
+          Args constants, rest;
+          for (auto arg : flat)
+            (nodes[arg].token.is_value() ? constants : rest).push_back(arg);
+          if (constants.size() > 1 && !rest.empty()) {
+            rest.push_back(this->value(this->fold(token, constants)));
+            flat = rest;
+          }
+        }
+        if (flat.size() == 1)
+          return flat[0];
+        if (constant_args(flat))
+          return this->value(this->fold(token, flat));
+        if (commutative(token))
+          std::sort(flat.begin(), flat.end(), [&](auto a, auto b) { return this->before(a, b); });
+        return this->add(Token(token.function(), flat.size()), flat);
+      }
+
+      size_t apply_binary(Token token, Args args) {
+        auto x = nodes[args[0]].token, y = nodes[args[1]].token;
+        switch (token.operator_()) {
+          case Operator::Add:
+            // x + 0 drops the sign of a negative zero x, which we accept
+            if (is_constant(y, 0)) return args[0];
+            if (is_constant(x, 0)) return args[1];
+            break;
+          case Operator::Sub:
+            if (is_constant(y, 0)) return args[0];
+            break;
+          case Operator::Mul:
+            if (is_constant(y, 1)) return args[0];
+            if (is_constant(x, 1)) return args[1];
+            break;
+          case Operator::Div:
+            if (is_constant(y, 1)) return args[0];
+            break;
+          case Operator::Exp:
+            if (is_constant(y, 0)) return this->value(1);
+            if (is_constant(y, 1)) return args[0];
+            // powf is not exact on every square, so Float32 keeps the call
+            if (is_constant(y, 2) && !single)
+              return this->apply(Token(Operator::Mul), { args[0], args[0] });
+            break;
+          default:
+            break;
+        }
+        if (commutative(token) && this->before(args[1], args[0]))
+          std::swap(args[0], args[1]);
+        return this->add(token, args);
+      }
+
+     public:
+      // how many compound nodes turned out to exist already
+      size_t merged = 0;
+
+      explicit Tree(parser::Math::Mode mode = parser::Math::Strict): single(mode == parser::Math::Float32) {}
+
+      void reserve(size_t n) {
+        nodes.reserve(n);
+      }
+
+      size_t size() const {
+        return nodes.size();
+      }
+
+      size_t leaf(const Token &token) {
+        return this->add(token, {});
+      }
+
+      // Adds token applied to args, rewritten into its simplest form, and
+      // returns the node that computes it.
+      size_t apply(Token token, Args args) {
+        if (token.is_function()) {
+          auto fn = token.function();
+          if (fn == Function::Pow)
+            return this->apply(Token(Operator::Exp), { args[0], args[1] });
+          if (Function::arity(fn) == -1 && !args.empty())
+            return this->apply_variadic(token, std::move(args));
+          // arguments past the arity are never read
+          if (Function::arity(fn) >= 0 && (int)args.size() > Function::arity(fn))
+            args.resize(Function::arity(fn));
+        } else if (token.operator_() == Operator::Pos)
+          return args[0];
+        else if (token.operator_() == Operator::Neg && nodes[args[0]].token.operator_() == Operator::Neg)
+          return nodes[args[0]].args[0];
+        if (constant_args(args)) {
+          double folded = this->fold(token, args);
+          if (this->exact(token, folded))
+            return this->value(folded);
+        }
+        if (token.is_operator() && token.operator_arity() == 2)
+          return this->apply_binary(token, std::move(args));
+        if (token.is_function())
+          token = Token(token.function(), args.size());
+        return this->add(token, std::move(args));
+      }
+
+      // Writes the DAG under roots back out in postfix order, one root after
+      // the other, each popped into its output if outputs is set. A compound
+      // node used more than once, by one root or several, is computed the
+      // first time it is reached and stored in a temporary, which every later
+      // use loads.
+      void flatten(const Args &roots, bool outputs, parser::TokenizedExpr &out) const {
+        arena::Vector<unsigned int> uses(nodes.size()), temp(nodes.size(), -1);
+        Args pending;
+        for (auto root : roots)
+          if (!uses[root]++)
+            pending.push_back(root);
+        while (!pending.empty()) {
+          auto i = pending.back();
+          pending.pop_back();
+          for (auto arg : nodes[i].args)
+            if (!uses[arg]++)
+              pending.push_back(arg);
+        }
+        unsigned int temps = 0;
+        for (size_t k = 0; k < roots.size(); k++) {
+          this->flatten(roots[k], uses, temp, temps, out);
+          if (outputs)
+            out.push_back(Token::output(k));
+        }
+      }
+
+      void flatten(size_t root, const arena::Vector<unsigned int> &uses, arena::Vector<unsigned int> &temp,
+          unsigned int &temps, parser::TokenizedExpr &out) const {
+        arena::Vector<std::pair<size_t, size_t>> stack { { root, 0 } };
+        while (!stack.empty()) {
+          auto &top = stack.back();
+          auto &node = nodes[top.first];
+          if (top.second == 0 && temp[top.first] != (unsigned int)-1) {
+            out.push_back(Token::load(temp[top.first]));
+            stack.pop_back();
+          } else if (top.second < node.args.size())
+            stack.push_back({ node.args[top.second++], 0 });
+          else {
+            out.push_back(node.token);
+            if (uses[top.first] > 1 && !node.args.empty()) {
+              temp[top.first] = temps++;
+              out.push_back(Token::store(temp[top.first]));
+            }
+            stack.pop_back();
+          }
+        }
+      }
+    };
+
+    // Adds program to tree and appends the node of its result, or of each of
+    // its outputs in order, to roots.
+    void read(Tree &tree, const parser::Program &program, Args &roots) {
+      Args stack, temps(program.temps()), outputs(program.outputs());
+      for (auto &token : program.code()) {
+        if (token.is_value() || token.is_variable()) {
+          stack.push_back(tree.leaf(token));
+          continue;
+        }
+        if (token.is_store()) {
+          temps[token.temp()] = stack.back();
+          continue;
+        }
+        if (token.is_load()) {
+          stack.push_back(temps[token.temp()]);
+          continue;
+        }
+        if (token.is_output()) {
+          outputs[token.output()] = stack.back();
+          stack.pop_back();
+          continue;
+        }
+        size_t n = token.is_operator() ? token.operator_arity() : token.function_argc();
+        Args args(stack.end() - n, stack.end());
+        stack.erase(stack.end() - n, stack.end());
+        stack.push_back(tree.apply(token, std::move(args)));
+      }
+      if (program.outputs())
+        roots.insert(roots.end(), outputs.begin(), outputs.end());
+      else
+        roots.push_back(stack.back());
+    }
+
+    // program has been read in full, so out may be the same program
+    bool write(const Tree &tree, const Args &roots, bool outputs, parser::Program &out) {
+      auto code = out.recycle();
+      code.clear();
+      tree.flatten(roots, outputs, code);
+      if (debug) {
+        for (auto &t : code)
+          fprintf(parser::diagnostics, "%s ", t.to_string().c_str());
+        fprintf(parser::diagnostics, "\n%zu nodes, %zu merged\n", tree.size(), tree.merged);
+      }
+      return parser::Program::create(std::move(code), out);
+    }
+  }
+
+  // Folds constant subexpressions with the interpreter's own tables, removes
+  // identities (x*1, x+0, x**1, x**2 -> x*x, ...), merges nested hypot, max and
+  // min calls and orders the operands of commutative operations, so formulas
+  // that differ only in such ways simplify to the same program. Repeated
+  // subexpressions are merged and evaluated only once. Constants fold in the
+  // precision mode computes in.
+  bool simplify(const parser::Program &program, parser::Program &out,
+      parser::Math::Mode mode = parser::Math::Strict) {
+    stats::Timer timer(stats::Simplify);
+    Tree tree(mode);
+    tree.reserve(program.code().size());
+    Args roots;
+    read(tree, program, roots);
+    return write(tree, roots, program.outputs() > 0, out);
+  }
+
+  // Simplifies programs into one fused program with an output for each, in
+  // order (or for each output of a fused one). Subexpressions common to
+  // several programs are computed once for all of them. The programs must
+  // number their input slots the same way, as they do when parsed with one
+  // table of variables.
+  bool fuse(const std::vector<parser::Program> &programs, parser::Program &out,
+      parser::Math::Mode mode = parser::Math::Strict) {
+    stats::Timer timer(stats::Simplify);
+    Tree tree(mode);
+    Args roots;
+    for (auto &program : programs)
+      read(tree, program, roots);
+    return write(tree, roots, true, out);
+  }
+}
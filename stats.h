@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Define STATS_ENABLED to 0 to compile every timer out.
+#ifndef STATS_ENABLED
+#define STATS_ENABLED 1
+#endif
+
+namespace stats {
+  enum Stage {
+    Tokenize, ShuntingYard, Simplify, Bytecode, Eval, Batch, Build, Optimize, Jit,
+    Stages
+  };
+
+  inline const char *name(Stage stage) {
+    static const char *names[] = {
+      "tokenize", "shunting_yard", "simplify", "bytecode", "eval", "batch", "ir_build", "optimize", "jit"
+    };
+    return names[stage];
+  }
+
+  // What one stage has cost since the last reset. Heap allocations are those
+  // of the whole process while the stage ran, as counted by allocated().
+  struct Counter {
+    uint64_t calls = 0;
+    uint64_t ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t allocations = 0;
+  };
+
+  struct Snapshot {
+    Counter stages[Stages];
+    uint64_t allocations = 0;
+  };
+
+  namespace {
+    struct Atomic {
+      std::atomic<uint64_t> calls { 0 }, ns { 0 }, max_ns { 0 }, allocations { 0 };
+    };
+
+    // Counting is off until enable(), so that a timer costs one relaxed load.
+    std::atomic<bool> on { false };
+    std::atomic<uint64_t> heap { 0 };
+    Atomic counters[Stages];
+  }
+
+  inline void enable(bool enabled = true) {
+    on.store(enabled, std::memory_order_relaxed);
+  }
+
+  inline bool enabled() {
+    return STATS_ENABLED && on.load(std::memory_order_relaxed);
+  }
+
+  // For a replacement operator new to call, if the program has one.
+  inline void allocated() {
+    heap.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline uint64_t allocations() {
+    return heap.load(std::memory_order_relaxed);
+  }
+
+  // Adds the time from its construction to its destruction to stage. Timers
+  // may nest; each stage counts its own time including that of stages it
+  // calls into.
+  class Timer {
+#if STATS_ENABLED
+    Stage stage;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+    uint64_t heap_start = 0;
+
+   public:
+    explicit Timer(Stage stage): stage(stage), active(enabled()) {
+      if (!active)
+        return;
+      heap_start = allocations();
+      start = std::chrono::steady_clock::now();
+    }
+
+    ~Timer() {
+      if (!active)
+        return;
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+      auto &counter = counters[stage];
+      counter.calls.fetch_add(1, std::memory_order_relaxed);
+      counter.ns.fetch_add(ns, std::memory_order_relaxed);
+      counter.allocations.fetch_add(allocations() - heap_start, std::memory_order_relaxed);
+      uint64_t max = counter.max_ns.load(std::memory_order_relaxed);
+      while (ns > max && !counter.max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+    }
+#else
+   public:
+    explicit Timer(Stage) {}
+#endif
+
+    Timer(const Timer&) = delete;
+    Timer &operator=(const Timer&) = delete;
+  };
+
+  inline Snapshot snapshot() {
+    Snapshot out;
+    for (int stage = 0; stage < Stages; stage++) {
+      auto &counter = counters[stage];
+      out.stages[stage].calls = counter.calls.load(std::memory_order_relaxed);
+      out.stages[stage].ns = counter.ns.load(std::memory_order_relaxed);
+      out.stages[stage].max_ns = counter.max_ns.load(std::memory_order_relaxed);
+      out.stages[stage].allocations = counter.allocations.load(std::memory_order_relaxed);
+    }
+    out.allocations = allocations();
+    return out;
+  }
+
+  inline void reset() {
+    for (auto &counter : counters) {
+      counter.calls = 0;
+      counter.ns = 0;
+      counter.max_ns = 0;
+      counter.allocations = 0;
+    }
+  }
+
+  // Stages that never ran are left out.
+  inline std::string json(const Snapshot &snapshot) {
+    std::string out = "{\n  \"stages\": {";
+    bool first = true;
+    char buf[256];
+    for (int stage = 0; stage < Stages; stage++) {
+      auto &counter = snapshot.stages[stage];
+      if (!counter.calls)
+        continue;
+      snprintf(buf, sizeof(buf), "%s\n    \"%s\": { \"calls\": %llu, \"ns\": %llu, \"ns_per_call\": %.1lf, "
+        "\"max_ns\": %llu, \"allocations\": %llu }", first ? "" : ",", name((Stage)stage),
+        (unsigned long long)counter.calls, (unsigned long long)counter.ns, (double)counter.ns / counter.calls,
+        (unsigned long long)counter.max_ns, (unsigned long long)counter.allocations);
+      out += buf;
+      first = false;
+    }
+    snprintf(buf, sizeof(buf), "\n  },\n  \"allocations\": %llu\n}\n", (unsigned long long)snapshot.allocations);
+    return out + buf;
+  }
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "parser.h"
+#include "simplify.h"
+#include "vm.h"
+
+namespace stream {
+  // Reads newline-delimited lines from a file or stdin. A regular file is
+  // mapped and its lines are handed out in place; anything else is read in
+  // large blocks into a buffer that grows only for longer lines.
+  class Reader {
+    int fd = -1;
+    const char *data = nullptr;
+    size_t size = 0, pos = 0;
+    bool mapped = false, eof = false;
+    std::vector<char> buffer;
+    size_t begin = 0, end = 0;
+
+   public:
+    static const size_t block = 1 << 20;
+
+    Reader() = default;
+    Reader(const Reader&) = delete;
+    Reader &operator=(const Reader&) = delete;
+
+    ~Reader() {
+      if (mapped)
+        munmap((void*)data, size);
+      if (fd > 0)
+        close(fd);
+    }
+
+    // An empty path or "-" reads stdin.
+    bool open(const std::string &path) {
+      fd = path.empty() || path == "-" ? 0 : ::open(path.c_str(), O_RDONLY);
+      // stdout is where results go
+      if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+      }
+      struct stat info;
+      if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+          madvise(map, info.st_size, MADV_SEQUENTIAL);
+          data = (const char*)map;
+          size = info.st_size;
+          mapped = true;
+          return true;
+        }
+      }
+      buffer.resize(block);
+      return true;
+    }
+
+    // The next line without its line break; the pointer stays valid until
+    // the next call.
+    bool next(const char *&line, size_t &length) {
+      if (mapped) {
+        if (pos >= size)
+          return false;
+        line = data + pos;
+        auto newline = (const char*)memchr(line, '\n', size - pos);
+        length = newline ? newline - line : size - pos;
+        pos += length + 1;
+      } else {
+        const char *newline;
+        while (!(newline = (const char*)memchr(buffer.data() + begin, '\n', end - begin)) && !eof) {
+          // keep the partial line and read behind it
+          memmove(buffer.data(), buffer.data() + begin, end - begin);
+          end -= begin;
+          begin = 0;
+          if (end == buffer.size())
+            buffer.resize(buffer.size() * 2);
+          ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n <= 0)
+            eof = true;
+          else
+            end += n;
+        }
+        if (!newline && begin == end)
+          return false;
+        line = buffer.data() + begin;
+        length = newline ? newline - line : end - begin;
+        begin += length + (newline ? 1 : 0);
+      }
+      if (length && line[length - 1] == '\r')
+        length--;
+      return true;
+    }
+  };
+
+  // Collects results in one large buffer and writes it out whenever it fills,
+  // rather than going through printf for every line.
+  class Writer {
+    FILE *file;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    void reserve(size_t n) {
+      if (used + n > buffer.size())
+        this->flush();
+    }
+
+   public:
+    explicit Writer(FILE *file = stdout, size_t capacity = 1 << 20): file(file), buffer(capacity) {}
+    Writer(const Writer&) = delete;
+    Writer &operator=(const Writer&) = delete;
+
+    ~Writer() {
+      this->flush();
+    }
+
+    // %.17g, so that a value reads back as exactly the same double.
+    void put(double value) {
+      this->reserve(32);
+      used += snprintf(buffer.data() + used, 32, "%.17g\n", value);
+    }
+
+    void error() {
+      this->reserve(6);
+      memcpy(buffer.data() + used, "error\n", 6);
+      used += 6;
+    }
+
+    void flush() {
+      if (used)
+        fwrite(buffer.data(), 1, used, file);
+      fflush(file);
+      used = 0;
+    }
+  };
+
+  // Turns lines into bytecode, reusing its buffers from one line to the next
+  // and taking all scratch memory from an arena reset for every line, so that
+  // in the steady state a line needs no heap allocations at all. Lines may use
+  // the variables bound beforehand and no others.
+  class Translator {
+    const parser::Variables &names;
+    unsigned int level;
+    parser::Math::Mode mode;
+    arena::Arena scratch;
+    std::string text;
+    parser::TokenizedExpr infix;
+    parser::Variables variables;
+    parser::Program program, simplified;
+
+   public:
+    Translator(const parser::Variables &names, unsigned int level, parser::Math::Mode mode = parser::Math::Strict):
+      names(names), level(level), mode(mode), variables(names) {}
+
+    bool translate(const char *line, size_t length, vm::Bytecode &out) {
+      scratch.reset();
+      arena::Scope scope(scratch);
+      text.assign(line, length);
+      infix.clear();
+      variables.resize(names.size());
+      if (!parser::parse_infix(text, infix, variables))
+        return false;
+      if (variables.size() > names.size()) {
+        fprintf(parser::diagnostics, "Unbound variable '%s'\n", variables[names.size()].c_str());
+        return false;
+      }
+      if (!parser::shunting_yard(infix, program))
+        return false;
+      if (level) {
+        if (!simplify::simplify(program, simplified, mode))
+          return false;
+        return vm::Bytecode::compile(simplified, out, mode);
+      }
+      return vm::Bytecode::compile(program, out, mode);
+    }
+
+    const arena::Stats &stats() const {
+      return scratch.stats();
+    }
+  };
+
+  namespace {
+    // Lines are handed from the parsing thread to the evaluating one in
+    // batches, so that the two meet once per batch rather than per line.
+    struct Batch {
+      std::vector<vm::Bytecode> code;
+      std::vector<bool> ok;
+      size_t size = 0;
+    };
+
+    // Parses every line on a thread of its own and evaluates on the calling
+    // one; at most depth batches are in flight, and batches are recycled so
+    // their bytecode keeps its buffers.
+    void pipeline(Reader &reader, Writer &writer, Translator &translator, const double *values) {
+      const size_t lines = 256, depth = 4;
+      std::mutex lock;
+      std::condition_variable ready, drained;
+      std::deque<std::unique_ptr<Batch>> full, free;
+      bool finished = false;
+      for (size_t i = 0; i < depth; i++) {
+        free.push_back(std::make_unique<Batch>());
+        free.back()->code.resize(lines);
+        free.back()->ok.resize(lines);
+      }
+      std::thread parser([&]() {
+        const char *line;
+        size_t length;
+        bool more = true;
+        while (more) {
+          std::unique_ptr<Batch> batch;
+          {
+            std::unique_lock<std::mutex> guard(lock);
+            drained.wait(guard, [&]() { return !free.empty(); });
+            batch = std::move(free.front());
+            free.pop_front();
+          }
+          for (batch->size = 0; batch->size < lines && (more = reader.next(line, length)); batch->size++)
+            batch->ok[batch->size] = translator.translate(line, length, batch->code[batch->size]);
+          std::lock_guard<std::mutex> guard(lock);
+          full.push_back(std::move(batch));
+          finished = !more;
+          ready.notify_one();
+        }
+      });
+      while (true) {
+        std::unique_ptr<Batch> batch;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          ready.wait(guard, [&]() { return !full.empty() || finished; });
+          if (full.empty())
+            break;
+          batch = std::move(full.front());
+          full.pop_front();
+        }
+        for (size_t i = 0; i < batch->size; i++) {
+          double out;
+          if (batch->ok[i] && vm::eval(batch->code[i], out, values))
+            writer.put(out);
+          else
+            writer.error();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        free.push_back(std::move(batch));
+        drained.notify_one();
+      }
+      parser.join();
+    }
+  }
+
+  // Evaluates every line of reader with the values bound to names and writes
+  // one result per line, or "error" for a line that does not parse. With
+  // pipelined, parsing runs on a second thread. Diagnostics go to stderr
+  // meanwhile, so that results are the only lines on stdout.
+  void run(Reader &reader, Writer &writer, const parser::Variables &names, const std::vector<double> &values,
+      unsigned int level = 0, bool pipelined = false, parser::Math::Mode mode = parser::Math::Strict) {
+    Translator translator(names, level, mode);
+    FILE *diagnostics = parser::diagnostics;
+    parser::diagnostics = stderr;
+    if (pipelined) {
+      pipeline(reader, writer, translator, values.data());
+      writer.flush();
+      parser::diagnostics = diagnostics;
+      return;
+    }
+    vm::Bytecode bytecode;
+    const char *line;
+    size_t length;
+    while (reader.next(line, length)) {
+      double out;
+      if (translator.translate(line, length, bytecode) && vm::eval(bytecode, out, values.data()))
+        writer.put(out);
+      else
+        writer.error();
+    }
+    writer.flush();
+    parser::diagnostics = diagnostics;
+  }
+}
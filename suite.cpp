@@ -0,0 +1,538 @@
+#include <chrono>
+#include <cstring>
+#include <random>
+
+#include <sys/resource.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "incremental.h"
+#include "llir.h"
+#include "parser.h"
+#include "simplify.h"
+#include "stats.h"
+#include "tier.h"
+#include "vm.h"
+
+// Times every stage of the pipeline over a generated corpus of expressions and
+// prints the results as one JSON object, so that runs can be compared.
+
+struct Options {
+  size_t count = 64;
+  size_t size = 64;
+  unsigned int depth = 4;
+  unsigned int variables = 4;
+  size_t rows = 10000;
+  unsigned int repeat = 10;
+  unsigned int level = 0;
+  unsigned int seed = 1;
+  unsigned int threads = 0;
+  size_t cache = 16 << 20;
+  uint64_t threshold = 1000;
+  std::string math = "strict";
+  parser::Math::Mode mode = parser::Math::Strict;
+  std::string objects;
+  bool stats = false;
+  std::vector<std::string> operators;
+  std::vector<std::string> functions;
+};
+
+namespace {
+  std::vector<std::string> split(const char *list) {
+    std::vector<std::string> out;
+    for (const char *comma; (comma = strchr(list, ',')); list = comma + 1)
+      out.emplace_back(list, comma - list);
+    out.emplace_back(list);
+    return out;
+  }
+
+  std::string join(const std::vector<std::string> &names) {
+    std::string out;
+    for (auto &name : names)
+      out += (out.empty() ? "" : ",") + name;
+    return out;
+  }
+
+  bool match(const char *arg, const char *name, const char *&value) {
+    size_t n = strlen(name);
+    if (strncmp(arg, name, n) || arg[n] != '=')
+      return false;
+    value = arg + n + 1;
+    return true;
+  }
+}
+
+// Arguments are --name=value; operators and functions take comma separated
+// lists of spellings and default to everything the lexer knows.
+bool parse_args(int argc, char *argv[], Options &options) {
+  for (auto &kv : parser::token_to_operator)
+    if (kv.second != parser::Operator::Sep && !parser::Operator::sentinel(kv.second) &&
+        kv.second != parser::Operator::Rbr)
+      options.operators.push_back(kv.first);
+  for (auto &kv : parser::token_to_function)
+    options.functions.push_back(kv.first);
+  for (int i = 1; i < argc; i++) {
+    const char *value;
+    if (match(argv[i], "--count", value))
+      options.count = strtoul(value, nullptr, 10);
+    else if (match(argv[i], "--size", value))
+      options.size = strtoul(value, nullptr, 10);
+    else if (match(argv[i], "--depth", value))
+      options.depth = strtoul(value, nullptr, 10);
+    else if (match(argv[i], "--variables", value))
+      options.variables = strtoul(value, nullptr, 10);
+    else if (match(argv[i], "--rows", value))
+      options.rows = strtoul(value, nullptr, 10);
+    else if (match(argv[i], "--repeat", value))
+      options.repeat = std::max(1ul, strtoul(value, nullptr, 10));
+    else if (match(argv[i], "--threads", value))
+      options.threads = strtoul(value, nullptr, 10);
+    else if (!strcmp(argv[i], "--stats"))
+      options.stats = true;
+    else if (match(argv[i], "--objects", value))
+      options.objects = value;
+    else if (match(argv[i], "--cache", value))
+      options.cache = strtoull(value, nullptr, 10);
+    else if (match(argv[i], "--threshold", value))
+      options.threshold = strtoull(value, nullptr, 10);
+    else if (match(argv[i], "--math", value)) {
+      options.math = value;
+      if (!parser::Math::parse(options.math, options.mode))
+        return false;
+    } else if (match(argv[i], "--seed", value))
+      options.seed = strtoul(value, nullptr, 10);
+    else if (match(argv[i], "--operators", value))
+      options.operators = split(value);
+    else if (match(argv[i], "--functions", value))
+      options.functions = *value ? split(value) : std::vector<std::string>();
+    else if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3])
+      options.level = argv[i][2] - '0';
+    else {
+      printf("Unknown argument '%s'\n", argv[i]);
+      return false;
+    }
+  }
+  for (auto &op : options.operators)
+    if (!parser::token_to_operator.count(op)) {
+      printf("Unknown operator '%s'\n", op.c_str());
+      return false;
+    }
+  for (auto &fn : options.functions)
+    if (!parser::token_to_function.count(fn)) {
+      printf("Unknown function '%s'\n", fn.c_str());
+      return false;
+    }
+  return true;
+}
+
+// Random expressions over the chosen operators and functions, nested at most
+// depth deep. Leaves are numbers, the constants and the variables x0, x1, ...
+class Generator {
+  const Options &options;
+  std::mt19937 rng;
+  size_t tokens = 0;
+
+  size_t pick(size_t n) {
+    return std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+  }
+
+  std::string leaf() {
+    tokens++;
+    switch (pick(options.variables ? 4 : 3)) {
+      case 0: return pick(2) ? "pi" : "e";
+      case 1:
+      case 2: {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.3g", std::uniform_real_distribution<double>(0.1, 100)(rng));
+        return buf;
+      }
+      default: return "x" + std::to_string(pick(options.variables));
+    }
+  }
+
+  std::string node(unsigned int depth) {
+    size_t choices = options.operators.size() + options.functions.size();
+    if (!depth || !choices || !pick(3))
+      return this->leaf();
+    auto i = pick(choices);
+    if (i < options.operators.size()) {
+      auto &op = options.operators[i];
+      if (op == "~") {
+        tokens++;
+        return "~" + this->node(depth - 1);
+      }
+      tokens += 3;
+      return "(" + this->node(depth - 1) + " " + op + " " + this->node(depth - 1) + ")";
+    }
+    auto &fn = options.functions[i - options.operators.size()];
+    int arity = parser::Function::arity(parser::token_to_function.at(fn));
+    size_t argc = arity < 0 ? 1 + pick(4) : arity;
+    std::string out = fn + "(";
+    tokens += 2 + argc;
+    for (size_t k = 0; k < argc; k++)
+      out += (k ? ", " : "") + this->node(depth - 1);
+    return out + ")";
+  }
+
+ public:
+  Generator(const Options &options): options(options), rng(options.seed) {}
+
+  // Joins random terms with + and - until the expression has about size tokens.
+  std::string expression() {
+    tokens = 0;
+    std::string out = this->node(options.depth);
+    while (tokens < options.size) {
+      tokens++;
+      out += (pick(2) ? " + " : " - ") + this->node(options.depth);
+    }
+    return out;
+  }
+};
+
+namespace {
+  typedef std::chrono::duration<double, std::nano> Nanos;
+
+  long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  template<typename F>
+  double time_ns(F fn) {
+    auto start = std::chrono::steady_clock::now();
+    if (!fn())
+      return -1;
+    return Nanos(std::chrono::steady_clock::now() - start).count();
+  }
+
+  void stage(bool first, const char *name, double ns, double per, const char *unit, double rate = 0) {
+    printf("%s\n    \"%s\": { \"ns\": %.0lf, \"%s\": %.3lf", first ? "" : ",", name, ns, unit, per);
+    if (rate)
+      printf(", \"tokens_per_sec\": %.0lf", rate);
+    printf(", \"peak_rss_kb\": %ld }", peak_rss_kb());
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!parse_args(argc, argv, options))
+    return 1;
+  // the library's own counters, which also time every row the interpreter runs
+  stats::enable(options.stats);
+
+  Generator generator(options);
+  std::vector<std::string> corpus;
+  size_t bytes = 0;
+  for (size_t i = 0; i < options.count; i++) {
+    corpus.push_back(generator.expression());
+    bytes += corpus.back().length();
+  }
+
+  std::vector<parser::TokenizedExpr> infix(corpus.size());
+  std::vector<parser::Variables> variables(corpus.size());
+  size_t tokens = 0;
+  double tokenize = time_ns([&]() {
+    for (unsigned int r = 0; r < options.repeat; r++)
+      for (size_t i = 0; i < corpus.size(); i++) {
+        infix[i].clear();
+        variables[i].clear();
+        if (!parser::parse_infix(corpus[i], infix[i], variables[i]))
+          return false;
+      }
+    return true;
+  });
+  for (auto &expr : infix)
+    tokens += expr.size();
+
+  std::vector<parser::Program> programs(corpus.size());
+  double shunting = time_ns([&]() {
+    for (unsigned int r = 0; r < options.repeat; r++)
+      for (size_t i = 0; i < corpus.size(); i++)
+        if (!parser::shunting_yard(infix[i], programs[i]))
+          return false;
+    return true;
+  });
+
+  // every expression reads the same rows of inputs, one slot per variable
+  std::vector<double> inputs(options.rows * std::max(1u, options.variables));
+  std::mt19937 rng(options.seed);
+  for (auto &x : inputs)
+    x = std::uniform_real_distribution<double>(-10, 10)(rng);
+  std::vector<std::vector<double>> rows(corpus.size());
+  // the lexer numbers slots in order of appearance, not by name
+  for (size_t i = 0; i < corpus.size(); i++)
+    for (size_t r = 0; r < options.rows; r++)
+      for (auto &name : variables[i])
+        rows[i].push_back(inputs[r * options.variables + atoi(name.c_str() + 1)]);
+
+  // results are summed into a volatile so that no evaluation is optimized away
+  volatile double sink = 0;
+  std::vector<vm::Bytecode> bytecode(corpus.size());
+  double lower = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      if (!vm::Bytecode::compile(programs[i], bytecode[i], options.mode))
+        return false;
+    return true;
+  });
+  double eval = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      for (size_t r = 0; r < options.rows; r++) {
+        double out;
+        vm::eval(bytecode[i], out, rows[i].data() + r * variables[i].size());
+        sink = sink + out;
+      }
+    return true;
+  });
+
+  llir::Compiler compiler;
+  compiler.math(options.mode);
+  double ir = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++) {
+      if (!compiler.build(programs[i]))
+        return false;
+    }
+    return true;
+  });
+
+  std::vector<llir::Kernel> kernels(corpus.size());
+  double jit = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      if (!compiler.jit(programs[i], kernels[i], options.level))
+        return false;
+    return true;
+  });
+  // the kernels are called below, so a failed compile stops here
+  if (jit < 0)
+    return 1;
+  // the whole corpus as one module
+  std::vector<llir::Kernel> together;
+  double jit_all = time_ns([&]() {
+    return compiler.jit_all(programs, together, options.level);
+  });
+  // with a directory to keep object code in, once stored and once linked from
+  // there, as a restarted process would
+  double stored = 0, linked = 0;
+  if (!options.objects.empty()) {
+    std::vector<llir::Kernel> kept(corpus.size());
+    for (double *ns : { &stored, &linked }) {
+      llir::Compiler persistent;
+      persistent.math(options.mode);
+      if (!persistent.persist(options.objects))
+        return 1;
+      *ns = time_ns([&]() {
+        for (size_t i = 0; i < corpus.size(); i++)
+          if (!persistent.jit(programs[i], kept[i], options.level))
+            return false;
+        return true;
+      });
+    }
+  }
+  double run = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      for (size_t r = 0; r < options.rows; r++)
+        sink = sink + kernels[i](rows[i].data() + r * variables[i].size());
+    return true;
+  });
+
+  // the same rows again as one column per slot of each expression
+  std::vector<std::vector<double>> columns(corpus.size());
+  std::vector<std::vector<const double*>> pointers(corpus.size());
+  std::vector<double> results(options.rows);
+  for (size_t i = 0; i < corpus.size(); i++) {
+    size_t slots = variables[i].size();
+    columns[i].resize(slots * options.rows);
+    for (size_t r = 0; r < options.rows; r++)
+      for (size_t k = 0; k < slots; k++)
+        columns[i][k * options.rows + r] = rows[i][r * slots + k];
+    for (size_t k = 0; k < slots; k++)
+      pointers[i].push_back(&columns[i][k * options.rows]);
+  }
+  double blocked = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      if (!batch::eval(programs[i], pointers[i].data(), options.rows, results.data()))
+        return false;
+    return true;
+  });
+
+  std::vector<llir::BatchKernel> loops(corpus.size());
+  double jit_batch = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      if (!compiler.jit_batch(programs[i], loops[i], std::max(2u, options.level)))
+        return false;
+    return true;
+  });
+  if (jit_batch < 0)
+    return 1;
+  double run_batch = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++) {
+      loops[i](pointers[i].data(), options.rows, results.data());
+      sink = sink + results[0];
+    }
+    return true;
+  });
+
+  // the whole corpus fused into one program over one table of variables, so
+  // that every input is loaded once per row for all of the outputs
+  parser::Variables shared;
+  std::vector<parser::Program> common(corpus.size());
+  for (size_t i = 0; i < corpus.size(); i++) {
+    parser::TokenizedExpr tokens;
+    if (!parser::parse_infix(corpus[i], tokens, shared) || !parser::shunting_yard(tokens, common[i]))
+      return 1;
+  }
+  parser::Program fused;
+  vm::Bytecode fused_bytecode;
+  double fuse = time_ns([&]() {
+    return simplify::fuse(common, fused, options.mode) && vm::Bytecode::compile(fused, fused_bytecode, options.mode);
+  });
+  std::vector<double> fused_columns(shared.size() * options.rows), fused_results(corpus.size() * options.rows);
+  std::vector<const double*> fused_inputs;
+  std::vector<double*> fused_outputs;
+  for (size_t k = 0; k < shared.size(); k++) {
+    for (size_t r = 0; r < options.rows; r++)
+      fused_columns[k * options.rows + r] = inputs[r * options.variables + atoi(shared[k].c_str() + 1)];
+    fused_inputs.push_back(&fused_columns[k * options.rows]);
+  }
+  for (size_t i = 0; i < corpus.size(); i++)
+    fused_outputs.push_back(&fused_results[i * options.rows]);
+  double fused_batch = time_ns([&]() {
+    return batch::eval(fused_bytecode, fused_inputs.data(), options.rows, fused_outputs.data());
+  });
+  llir::FusedBatchKernel fused_loop = nullptr;
+  double jit_fused = time_ns([&]() {
+    return compiler.jit_batch(fused, fused_loop, std::max(2u, options.level));
+  });
+  if (jit_fused < 0)
+    return 1;
+  double run_fused = time_ns([&]() {
+    fused_loop(fused_inputs.data(), options.rows, fused_outputs.data());
+    sink = sink + fused_results[0];
+    return true;
+  });
+
+  pool::Pool pool(options.threads);
+  double blocked_mt = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++)
+      if (!batch::eval(bytecode[i], pointers[i].data(), options.rows, results.data(), pool))
+        return false;
+    return true;
+  });
+  double run_batch_mt = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++) {
+      batch::parallel(pool, loops[i], variables[i].size(), pointers[i].data(), options.rows, results.data());
+      sink = sink + results[0];
+    }
+    return true;
+  });
+
+  // the first pass over the corpus misses and compiles, the others hit
+  cache::Cache cached(options.cache, options.level);
+  double lookup = time_ns([&]() {
+    std::shared_ptr<const cache::Entry> entry;
+    for (unsigned int r = 0; r < options.repeat; r++)
+      for (size_t i = 0; i < corpus.size(); i++)
+        if (!cached.get(corpus[i], entry))
+          return false;
+    return true;
+  });
+  auto counters = cached.stats();
+
+  // every expression is served by the interpreter at first and by its kernel
+  // once threshold rows in the background compile of it is done; first is
+  // the latency of adding an expression and evaluating it once
+  double first, tiered;
+  tier::Stats tiers;
+  {
+    tier::Engine engine(options.threshold, options.level, options.mode);
+    std::vector<std::shared_ptr<tier::Expression>> exprs(corpus.size());
+    first = time_ns([&]() {
+      for (size_t i = 0; i < corpus.size(); i++) {
+        if (!engine.add(programs[i], exprs[i]))
+          return false;
+        sink = sink + exprs[i]->eval(rows[i].data());
+      }
+      return true;
+    });
+    tiered = time_ns([&]() {
+      for (size_t i = 0; i < corpus.size(); i++)
+        for (size_t r = 0; r < options.rows; r++)
+          sink = sink + exprs[i]->eval(rows[i].data() + r * variables[i].size());
+      return true;
+    });
+    engine.wait();
+    tiers = engine.stats();
+  }
+
+  // every row changes one input of the row before, as when a user tweaks one
+  // parameter, and only the nodes that depend on it are computed again
+  size_t nodes = 0, recomputed = 0;
+  std::vector<incremental::Evaluator> evaluators(corpus.size());
+  for (size_t i = 0; i < corpus.size(); i++) {
+    parser::Program simplified;
+    if (options.level ? !simplify::simplify(programs[i], simplified) ||
+          !incremental::Evaluator::create(simplified, evaluators[i]) :
+        !incremental::Evaluator::create(programs[i], evaluators[i]))
+      return 1;
+    evaluators[i].reset(rows[i].data());
+    nodes += evaluators[i].size();
+  }
+  double updated = time_ns([&]() {
+    for (size_t i = 0; i < corpus.size(); i++) {
+      size_t n = variables[i].size();
+      for (size_t r = 1; n && r < options.rows; r++) {
+        evaluators[i].set(r % n, rows[i][r * n + r % n]);
+        recomputed += evaluators[i].update();
+        sink = sink + evaluators[i].result();
+      }
+    }
+    return true;
+  });
+
+  if (fuse < 0 || fused_batch < 0 || jit_all < 0 || stored < 0 || linked < 0 || lookup < 0 || first < 0 || tiered < 0 || blocked_mt < 0 || tokenize < 0 || shunting < 0 || lower < 0 || ir < 0 || blocked < 0)
+    return 1;
+  double evals = (double)corpus.size() * options.rows, passes = (double)tokens * options.repeat;
+  printf("{\n  \"corpus\": { \"count\": %zu, \"size\": %zu, \"depth\": %u, \"variables\": %u, \"seed\": %u,"
+    " \"bytes\": %zu, \"tokens\": %zu,\n    \"operators\": \"%s\", \"functions\": \"%s\" },\n",
+    corpus.size(), options.size, options.depth, options.variables, options.seed, bytes, tokens,
+    join(options.operators).c_str(), join(options.functions).c_str());
+  printf("  \"rows\": %zu, \"repeat\": %u, \"level\": %u, \"math\": \"%s\", \"threads\": %zu,\n",
+    options.rows, options.repeat, options.level, options.math.c_str(), pool.size());
+  printf("  \"cache\": { \"capacity\": %zu, \"hits\": %zu, \"misses\": %zu, \"evictions\": %zu,"
+    " \"entries\": %zu, \"bytes\": %zu },\n", options.cache, counters.hits, counters.misses,
+    counters.evictions, counters.entries, counters.bytes);
+  printf("  \"tiers\": { \"threshold\": %llu, \"queued\": %zu, \"compiled\": %zu, \"failed\": %zu },\n",
+    (unsigned long long)options.threshold, tiers.queued, tiers.compiled, tiers.failed);
+  printf("  \"incremental\": { \"nodes_per_expr\": %.1lf, \"nodes_per_update\": %.2lf },\n  \"stages\": {",
+    (double)nodes / corpus.size(), recomputed / evals);
+  stage(true, "tokenize", tokenize / options.repeat, tokenize / passes, "ns_per_token", passes / tokenize * 1e9);
+  stage(false, "shunting_yard", shunting / options.repeat, shunting / passes, "ns_per_token", passes / shunting * 1e9);
+  stage(false, "bytecode", lower, lower / corpus.size(), "ns_per_expr");
+  stage(false, "eval", eval, eval / evals, "ns_per_eval");
+  stage(false, "ir", ir, ir / corpus.size(), "ns_per_expr");
+  stage(false, "jit", jit, jit / corpus.size(), "ns_per_expr");
+  stage(false, "jit_all", jit_all, jit_all / corpus.size(), "ns_per_expr");
+  if (!options.objects.empty()) {
+    stage(false, "jit_store", stored, stored / corpus.size(), "ns_per_expr");
+    stage(false, "jit_linked", linked, linked / corpus.size(), "ns_per_expr");
+  }
+  stage(false, "kernel", run, run / evals, "ns_per_eval");
+  stage(false, "batch", blocked, blocked / evals, "ns_per_eval");
+  stage(false, "jit_batch", jit_batch, jit_batch / corpus.size(), "ns_per_expr");
+  stage(false, "batch_kernel", run_batch, run_batch / evals, "ns_per_eval");
+  stage(false, "fuse", fuse, fuse / corpus.size(), "ns_per_expr");
+  stage(false, "fused_batch", fused_batch, fused_batch / evals, "ns_per_eval");
+  stage(false, "jit_fused_batch", jit_fused, jit_fused / corpus.size(), "ns_per_expr");
+  stage(false, "fused_batch_kernel", run_fused, run_fused / evals, "ns_per_eval");
+  stage(false, "batch_threads", blocked_mt, blocked_mt / evals, "ns_per_eval");
+  stage(false, "batch_kernel_threads", run_batch_mt, run_batch_mt / evals, "ns_per_eval");
+  stage(false, "cache", lookup, lookup / (corpus.size() * options.repeat), "ns_per_lookup");
+  stage(false, "tier_first", first, first / corpus.size(), "ns_per_expr");
+  stage(false, "tiered", tiered, tiered / evals, "ns_per_eval");
+  stage(false, "incremental", updated, updated / evals, "ns_per_eval");
+  printf("\n  },\n");
+  if (options.stats)
+    printf("  \"counters\": %s,\n", stats::json(stats::snapshot()).c_str());
+  printf("  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+  return 0;
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "llir.h"
+#include "parser.h"
+#include "simplify.h"
+#include "vm.h"
+
+namespace tier {
+  struct Stats {
+    // expressions added, sent to the compiler, and compiled or failed there
+    size_t expressions = 0;
+    size_t queued = 0;
+    size_t compiled = 0;
+    size_t failed = 0;
+  };
+
+  class Engine;
+
+  // One expression, evaluated by the interpreter until the engine has a
+  // native kernel for it and by that kernel from then on. Both run the same
+  // program, so the switch does not change results beyond libm's last bit.
+  // Safe to evaluate from several threads; the engine must outlive it.
+  class Expression: public std::enable_shared_from_this<Expression> {
+    friend class Engine;
+
+    Engine *engine;
+    parser::Program program;
+    vm::Bytecode bytecode;
+    std::atomic<llir::Kernel> kernel { nullptr };
+    std::atomic<uint64_t> calls { 0 };
+    llir::Tracker tracker;
+
+   public:
+    explicit Expression(Engine *engine): engine(engine) {}
+    Expression(const Expression&) = delete;
+    Expression &operator=(const Expression&) = delete;
+
+    ~Expression() {
+      if (tracker)
+        llvm::consumeError(tracker->remove());
+    }
+
+    inline double eval(const double *vars);
+
+    // whether the kernel has been swapped in
+    bool native() const {
+      return kernel.load(std::memory_order_acquire);
+    }
+
+    // evaluations the interpreter has served
+    uint64_t interpreted() const {
+      return calls.load(std::memory_order_relaxed);
+    }
+  };
+
+  // Serves new expressions from the bytecode interpreter right away and
+  // compiles those evaluated threshold times on a thread of its own, one at
+  // a time and in the order they got hot, so that only expressions that are
+  // used pay for LLVM and nobody waits for it.
+  class Engine {
+    friend class Expression;
+
+    uint64_t threshold;
+    unsigned int level;
+    parser::Math::Mode mode;
+    std::mutex lock;
+    std::condition_variable wake, idle;
+    std::deque<std::shared_ptr<Expression>> queue;
+    bool stopping = false, busy = false;
+    Stats counters;
+    // used by the compiling thread only
+    llir::Compiler compiler;
+    std::thread worker;
+
+    void promote(std::shared_ptr<Expression> expr) {
+      std::lock_guard<std::mutex> guard(lock);
+      queue.push_back(std::move(expr));
+      counters.queued++;
+      wake.notify_one();
+    }
+
+    void loop() {
+      while (true) {
+        std::shared_ptr<Expression> expr;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          busy = false;
+          if (queue.empty())
+            idle.notify_all();
+          wake.wait(guard, [&]() { return stopping || !queue.empty(); });
+          if (stopping)
+            return;
+          expr = std::move(queue.front());
+          queue.pop_front();
+          busy = true;
+        }
+        llir::Kernel kernel;
+        bool ok = compiler.jit(expr->program, kernel, level, &expr->tracker);
+        if (ok)
+          expr->kernel.store(kernel, std::memory_order_release);
+        std::lock_guard<std::mutex> guard(lock);
+        (ok ? counters.compiled : counters.failed)++;
+      }
+    }
+
+   public:
+    // An expression is compiled once it has been evaluated threshold times,
+    // or as soon as it is added for 0. level is the -O level and mode the
+    // math mode of both tiers.
+    explicit Engine(uint64_t threshold = 1000, unsigned int level = 2, parser::Math::Mode mode = parser::Math::Strict):
+        threshold(threshold), level(level), mode(mode) {
+      compiler.math(mode);
+      worker = std::thread([this]() { this->loop(); });
+    }
+
+    Engine(const Engine&) = delete;
+    Engine &operator=(const Engine&) = delete;
+
+    // Expressions still waiting to be compiled stay interpreted.
+    ~Engine() {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        wake.notify_one();
+      }
+      worker.join();
+    }
+
+    bool add(const parser::Program &program, std::shared_ptr<Expression> &out) {
+      auto expr = std::make_shared<Expression>(this);
+      if (!level)
+        expr->program = program;
+      else if (!simplify::simplify(program, expr->program, mode))
+        return false;
+      if (!vm::Bytecode::compile(expr->program, expr->bytecode, mode))
+        return false;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        counters.expressions++;
+      }
+      if (!threshold)
+        this->promote(expr);
+      out = std::move(expr);
+      return true;
+    }
+
+    bool add(const std::string &text, std::shared_ptr<Expression> &out, parser::Variables &variables) {
+      parser::TokenizedExpr infix;
+      parser::Program program;
+      return parser::parse_infix(text, infix, variables) && parser::shunting_yard(infix, program) &&
+        this->add(program, out);
+    }
+
+    // Blocks until every expression that has got hot so far is compiled.
+    void wait() {
+      std::unique_lock<std::mutex> guard(lock);
+      idle.wait(guard, [&]() { return queue.empty() && !busy; });
+    }
+
+    Stats stats() {
+      std::lock_guard<std::mutex> guard(lock);
+      return counters;
+    }
+  };
+
+  inline double Expression::eval(const double *vars) {
+    if (auto fn = kernel.load(std::memory_order_acquire))
+      return fn(vars);
+    // only the evaluation that crosses the threshold hands it over
+    if (calls.fetch_add(1, std::memory_order_relaxed) + 1 == engine->threshold)
+      engine->promote(this->shared_from_this());
+    return vm::run(bytecode, vars, nullptr);
+  }
+}
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <cstring>
+
+#include "parser.h"
+#include "stats.h"
+
+namespace vm {
+  // One opcode per operation the interpreter runs, so that dispatch is a single
+  // switch and every case knows its arity. The operand of an instruction is an
+  // index into the constant pool, an input slot or a temporary, or a count.
+  // Bit operators read and leave 64-bit integers, kept in the same 8 bytes as
+  // a double; Int and Float convert the value on top between the two, and
+  // IntVar reads an input slot as an integer. Single rounds the value on top
+  // to float, and Float, Exp and the functions of fixed arity run in single
+  // precision when their operand is 1.
+  enum Opcode : uint32_t {
+    Const, Var, IntVar, Store, Load, Drop, Zero, Output, Int, Float, Single,
+    And, Or, Xor, Rsh, Lsh, Add, Sub, Mul, Div, Rem, Exp, Not, Neg,
+    Abs, Acos, Acosh, Asin, Asinh, Atan, Atan2, Atanh, Cbrt, Ceil, Cos, Cosh,
+    Fexp, Floor, Log, Log10, Log2, Pow, Round, Sin, Sinh, Sqrt, Tan, Tanh, Trunc,
+    Hypot, Max, Min
+  };
+
+  struct Instr {
+    Opcode op;
+    uint32_t arg;
+  };
+  static_assert(sizeof(Instr) == 8, "instructions are packed into 8 bytes");
+
+  namespace {
+    inline int64_t bits(double x) {
+      int64_t i;
+      memcpy(&i, &x, sizeof(i));
+      return i;
+    }
+
+    inline double raw(int64_t i) {
+      double x;
+      memcpy(&x, &i, sizeof(x));
+      return x;
+    }
+
+    // What the reader of a value needs it as; dropped arguments are never read.
+    enum Want : char { Real, Integer, Any };
+
+    // Finds, for every token that leaves a value, what its reader needs, so
+    // that each value is converted once, right where it is computed, and
+    // integer constants are pooled as integers.
+    void readers(const parser::Program &program, arena::Vector<Want> &want) {
+      arena::Vector<size_t> stack;
+      auto &code = program.code();
+      want.assign(code.size(), Real);
+      auto read = [&](size_t n, Want as) {
+        for (; n && !stack.empty(); n--) {
+          want[stack.back()] = as;
+          stack.pop_back();
+        }
+      };
+      for (size_t i = 0; i < code.size(); i++) {
+        auto &token = code[i];
+        if (token.is_value() || token.is_variable() || token.is_load())
+          stack.push_back(i);
+        else if (token.is_output())
+          read(1, Real);
+        else if (token.is_operator() && token.operator_() != parser::Operator::Pos) {
+          read(parser::Operator::arity(token.operator_()),
+            parser::Operator::bitwise(token.operator_()) ? Integer : Real);
+          stack.push_back(i);
+        } else if (token.is_function()) {
+          int argc = token.function_argc(), arity = token.function_arity();
+          if (arity >= 0 && argc > arity)
+            read(argc - arity, Any);
+          read(arity >= 0 ? std::min(argc, arity) : argc, Real);
+          stack.push_back(i);
+        }
+      }
+      read(stack.size(), Real);
+    }
+
+    bool opcode(parser::Operator::Type op, Opcode &out) {
+      using namespace parser;
+      switch (op) {
+        case Operator::And: out = And; return true;
+        case Operator::Or:  out = Or;  return true;
+        case Operator::Xor: out = Xor; return true;
+        case Operator::Rsh: out = Rsh; return true;
+        case Operator::Lsh: out = Lsh; return true;
+        case Operator::Add: out = Add; return true;
+        case Operator::Sub: out = Sub; return true;
+        case Operator::Mul: out = Mul; return true;
+        case Operator::Div: out = Div; return true;
+        case Operator::Rem: out = Rem; return true;
+        case Operator::Exp: out = Exp; return true;
+        case Operator::Not: out = Not; return true;
+        case Operator::Neg: out = Neg; return true;
+        default: return false;
+      }
+    }
+
+    bool opcode(parser::Function::Type fn, Opcode &out) {
+      using namespace parser;
+      switch (fn) {
+        case Function::Abs:   out = Abs;   return true;
+        case Function::Acos:  out = Acos;  return true;
+        case Function::Acosh: out = Acosh; return true;
+        case Function::Asin:  out = Asin;  return true;
+        case Function::Asinh: out = Asinh; return true;
+        case Function::Atan:  out = Atan;  return true;
+        case Function::Atan2: out = Atan2; return true;
+        case Function::Atanh: out = Atanh; return true;
+        case Function::Cbrt:  out = Cbrt;  return true;
+        case Function::Ceil:  out = Ceil;  return true;
+        case Function::Cos:   out = Cos;   return true;
+        case Function::Cosh:  out = Cosh;  return true;
+        case Function::Exp:   out = Fexp;  return true;
+        case Function::Floor: out = Floor; return true;
+        case Function::Log:   out = Log;   return true;
+        case Function::Log10: out = Log10; return true;
+        case Function::Log2:  out = Log2;  return true;
+        case Function::Pow:   out = Pow;   return true;
+        case Function::Round: out = Round; return true;
+        case Function::Sin:   out = Sin;   return true;
+        case Function::Sinh:  out = Sinh;  return true;
+        case Function::Sqrt:  out = Sqrt;  return true;
+        case Function::Tan:   out = Tan;   return true;
+        case Function::Tanh:  out = Tanh;  return true;
+        case Function::Trunc: out = Trunc; return true;
+        case Function::Hypot: out = Hypot; return true;
+        case Function::Max:   out = Max;   return true;
+        case Function::Min:   out = Min;   return true;
+        default: return false;
+      }
+    }
+  }
+
+  // A program lowered to fixed-width instructions for the interpreter loop.
+  // Like the program it comes from, it never changes once compiled.
+  class Bytecode {
+    std::vector<Instr> _code;
+    std::vector<double> _constants;
+    size_t _depth;
+    size_t _slots;
+    size_t _temps;
+    size_t _outputs;
+    parser::Math::Mode _mode;
+
+   public:
+    Bytecode(): _depth(0), _slots(0), _temps(0), _outputs(0), _mode(parser::Math::Strict) {}
+
+    // Reuses the buffers of out, which is left empty if program has a token
+    // the interpreter does not run. Float32 bytecode rounds every value to
+    // float where the code llir generates for it does, so the two agree; fast
+    // bytecode is strict, since the interpreter has nothing to gain from it.
+    static bool compile(const parser::Program &program, Bytecode &out,
+        parser::Math::Mode mode = parser::Math::Strict) {
+      stats::Timer timer(stats::Bytecode);
+      auto &code = out._code;
+      auto &constants = out._constants;
+      code.clear();
+      constants.clear();
+      code.reserve(program.code().size());
+      arena::Vector<Want> want;
+      readers(program, want);
+      // whether each temporary holds an integer, and the conversion the
+      // value last computed still needs; it waits for the stores that follow
+      // it, so that temporaries keep what was computed
+      arena::Vector<bool> integers(program.temps());
+      bool integer = false;
+      uint32_t single = mode == parser::Math::Float32;
+      Opcode convert = Const;
+      for (size_t i = 0; i < program.code().size(); i++) {
+        auto &token = program.code()[i];
+        Opcode op;
+        if (token.is_store()) {
+          code.push_back({ Store, token.temp() });
+          integers[token.temp()] = integer;
+          continue;
+        }
+        if (token.operator_() == parser::Operator::Pos)
+          continue;
+        if (convert != Const)
+          code.push_back({ convert, single });
+        convert = Const;
+        integer = false;
+        if (token.is_value()) {
+          code.push_back({ Const, (uint32_t)constants.size() });
+          integer = want[i] == Integer;
+          double value = single ? (float)token.value() : token.value();
+          constants.push_back(integer ? raw(parser::Operator::integer(value)) : value);
+        } else if (token.is_variable()) {
+          // a float input is rounded before it is read as an integer
+          integer = want[i] == Integer && !single;
+          code.push_back({ integer ? IntVar : Var, token.slot() });
+          if (single)
+            code.push_back({ Single, 0 });
+        } else if (token.is_load()) {
+          code.push_back({ Load, token.temp() });
+          integer = integers[token.temp()];
+        } else if (token.is_output())
+          code.push_back({ Output, token.output() });
+        else if (token.is_operator() && opcode(token.operator_(), op)) {
+          code.push_back({ op, op == Exp ? single : 0 });
+          integer = parser::Operator::bitwise(token.operator_());
+          // the rest are exact on floats
+          if (single && (op == Add || op == Sub || op == Mul || op == Div))
+            code.push_back({ Single, 0 });
+        } else if (token.is_function() && opcode(token.function(), op)) {
+          int argc = token.function_argc(), arity = token.function_arity();
+          if (arity >= 0) {
+            // arguments past the arity are never read
+            if (argc > arity)
+              code.push_back({ Drop, (uint32_t)(argc - arity) });
+            code.push_back({ op, single });
+          } else if (argc == 0)
+            code.push_back({ Zero, 0 });
+          else if (argc > 1) {
+            code.push_back({ op, (uint32_t)argc });
+            // hypot is computed in double, as llir does
+            if (single && op == Hypot)
+              code.push_back({ Single, 0 });
+          }
+        } else {
+          fprintf(parser::diagnostics, "Unsupported token '%s'\n", token.to_string().c_str());
+          code.clear();
+          constants.clear();
+          return false;
+        }
+        if (!token.is_output() && want[i] != Any && integer != (want[i] == Integer))
+          convert = integer ? Float : Int;
+      }
+      if (convert != Const)
+        code.push_back({ convert, single });
+      out._depth = program.depth();
+      out._slots = program.slots();
+      out._temps = program.temps();
+      out._outputs = program.outputs();
+      out._mode = mode;
+      return true;
+    }
+
+    const std::vector<Instr> &code() const {
+      return this->_code;
+    }
+
+    const std::vector<double> &constants() const {
+      return this->_constants;
+    }
+
+    size_t depth() const {
+      return this->_depth;
+    }
+
+    size_t slots() const {
+      return this->_slots;
+    }
+
+    size_t temps() const {
+      return this->_temps;
+    }
+
+    size_t outputs() const {
+      return this->_outputs;
+    }
+
+    parser::Math::Mode mode() const {
+      return this->_mode;
+    }
+  };
+
+  // Calls fn in double precision, or in single for an instruction of
+  // Float32 bytecode.
+  #define s_1(fn) (instr.arg ? (double)fn((float)acc) : fn(acc))
+  #define s_2(fn) (instr.arg ? (double)fn((float)top[-1], (float)acc) : fn(top[-1], acc))
+
+  // Runs bytecode over one row of input, vars holding one value per slot, and
+  // returns what is left on top of the stack; outputs receives the results of
+  // a fused program. The stack and temporaries live on the C stack unless the
+  // program needs more, and then in a buffer of the thread's that keeps its
+  // capacity from one call to the next. The value on top of the stack is kept
+  // in acc, so that a chain of operations runs in registers; top points one
+  // past the values below it. One slot past the deepest stack lets a variadic
+  // call store acc after its other arguments.
+  inline double run(const Bytecode &bytecode, const double *vars, double *outputs) {
+    stats::Timer timer(stats::Eval);
+    double local[64];
+    thread_local std::vector<double> heap;
+    double *stack = local;
+    size_t depth = bytecode.depth() + 1;
+    if (depth + bytecode.temps() > 64) {
+      if (heap.size() < depth + bytecode.temps())
+        heap.resize(depth + bytecode.temps());
+      stack = heap.data();
+    }
+    double *temps = stack + depth, *top = stack;
+    double acc = 0;
+    const double *constants = bytecode.constants().data();
+    for (auto &instr : bytecode.code())
+      switch (instr.op) {
+        case Const: *top++ = acc; acc = constants[instr.arg]; break;
+        case Var:   *top++ = acc; acc = vars[instr.arg]; break;
+        case IntVar: *top++ = acc; acc = raw(parser::Operator::integer(vars[instr.arg])); break;
+        case Store: temps[instr.arg] = acc; break;
+        case Load:  *top++ = acc; acc = temps[instr.arg]; break;
+        case Drop:  top -= instr.arg; acc = *top; break;
+        case Zero:  *top++ = acc; acc = 0; break;
+        case Output: outputs[instr.arg] = acc; acc = *--top; break;
+        case Int:   acc = raw(parser::Operator::integer(acc)); break;
+        case Float: acc = instr.arg ? (float)bits(acc) : (double)bits(acc); break;
+        case Single: acc = (float)acc; break;
+        case And:   acc = raw(bits(*--top) & bits(acc)); break;
+        case Or:    acc = raw(bits(*--top) | bits(acc)); break;
+        case Xor:   acc = raw(bits(*--top) ^ bits(acc)); break;
+        case Rsh:   acc = raw(parser::Operator::shift_right(bits(*--top), bits(acc))); break;
+        case Lsh:   acc = raw(parser::Operator::shift_left(bits(*--top), bits(acc))); break;
+        case Add:   acc = *--top + acc; break;
+        case Sub:   acc = *--top - acc; break;
+        case Mul:   acc = *--top * acc; break;
+        case Div:   acc = *--top / acc; break;
+        case Rem:   acc = fmod(*--top, acc); break;
+        case Exp:   acc = s_2(std::pow); top--; break;
+        case Not:   acc = raw(~bits(acc)); break;
+        case Neg:   acc = -acc; break;
+        case Abs:   acc = s_1(std::abs); break;
+        case Acos:  acc = s_1(std::acos); break;
+        case Acosh: acc = s_1(std::acosh); break;
+        case Asin:  acc = s_1(std::asin); break;
+        case Asinh: acc = s_1(std::asinh); break;
+        case Atan:  acc = s_1(std::atan); break;
+        case Atan2: acc = s_2(std::atan2); top--; break;
+        case Atanh: acc = s_1(std::atanh); break;
+        case Cbrt:  acc = s_1(std::cbrt); break;
+        case Ceil:  acc = s_1(std::ceil); break;
+        case Cos:   acc = s_1(std::cos); break;
+        case Cosh:  acc = s_1(std::cosh); break;
+        case Fexp:  acc = s_1(std::exp); break;
+        case Floor: acc = s_1(std::floor); break;
+        case Log:   acc = s_1(std::log); break;
+        case Log10: acc = s_1(std::log10); break;
+        case Log2:  acc = s_1(std::log2); break;
+        case Pow:   acc = s_2(std::pow); top--; break;
+        case Round: acc = s_1(std::round); break;
+        case Sin:   acc = s_1(std::sin); break;
+        case Sinh:  acc = s_1(std::sinh); break;
+        case Sqrt:  acc = s_1(std::sqrt); break;
+        case Tan:   acc = s_1(std::tan); break;
+        case Tanh:  acc = s_1(std::tanh); break;
+        case Trunc: acc = s_1(std::trunc); break;
+        case Hypot:
+          top -= instr.arg - 1;
+          top[instr.arg - 1] = acc;
+          acc = parser::Function::hypot(top, instr.arg);
+          break;
+        case Max:
+          top -= instr.arg - 1;
+          top[instr.arg - 1] = acc;
+          acc = parser::Function::tree(top, instr.arg, parser::Function::max);
+          break;
+        case Min:
+          top -= instr.arg - 1;
+          top[instr.arg - 1] = acc;
+          acc = parser::Function::tree(top, instr.arg, parser::Function::min);
+          break;
+      }
+    return acc;
+  }
+
+  bool eval(const Bytecode &bytecode, double &out, const double *vars = nullptr) {
+    out = run(bytecode, vars, nullptr);
+    return true;
+  }
+
+  // Runs a fused program, writing output k to outputs[k].
+  bool eval(const Bytecode &bytecode, double *outputs, const double *vars = nullptr) {
+    run(bytecode, vars, outputs);
+    return true;
+  }
+}